@@ -1,623 +1,4028 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
 #include <omp.h>
 #include <getopt.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include "rnated_internal.h"
 
 #define VERSION "0.1.0"
 #define INITIAL_CAPACITY 100
+#define READ_CHUNK_SIZE (1 << 20)
+#define DEFAULT_BLOCK_ROWS 64
+#define DEFAULT_TILE_SIZE 32   // Representatives per tile edge in full-matrix mode
+#define MAX_TILE_BLOCKS 1024   // Larger inputs grow the tiles instead
+#define BINARY_MAGIC "RNATEDB1"
+#define BINARY_VERSION 1
+#define BINARY_HEADER_SIZE 32
 
-typedef struct Node {
-    char label; // 'P' for pair, 'U' for unpaired, 'R' for root
-    struct Node** children;
-    int num_children;
-    int index; // Index in postorder traversal
-    int i, j; // Positions in the dot-bracket string
-} Node;
-
-typedef struct TreeInfo {
-    Node* root;
-    Node** postorder;
-    int postorder_size;
-    int* leftmost;
-    int* keyroots;
-    int num_keyroots;
-} TreeInfo;
+#define CHECKPOINT_MAGIC "RNATEDK1"
+#define CHECKPOINT_VERSION 2 // Units are tiles of representative pairs
+#define CHECKPOINT_HEADER_SIZE 40
+#define CHECKPOINT_SUFFIX ".ckpt"
+#define DEFAULT_CHECKPOINT_INTERVAL 300
+
+#define SHARD_MAGIC "RNATEDS1"
+#define SHARD_VERSION 1
+#define SHARD_HEADER_SIZE 64
+#define SHARD_RECORD_SIZE 16
+
+#define INDEX_MAGIC "RNATEDI1"
+#define INDEX_VERSION 1
+#define INDEX_HEADER_SIZE 64
+#define INDEX_RECORD_SIZE 40
+
+#define VPTREE_MAGIC "RNATEDV1"
+#define VPTREE_VERSION 1
+#define VPTREE_HEADER_SIZE 40
+#define VPTREE_TASK_SIZE 256   // Larger subtrees are built as separate tasks
+#define VPTREE_GRAIN 16        // Distances per task when measuring from a vantage point
+
+#define DEFAULT_MEDOID_SAMPLES 5
+#define DEFAULT_MEDOID_CACHE_MB 256
+#define MEDOID_SWAP_BLOCK 64   // Swap candidates evaluated together; fixed so results do not depend on threads
+#define MEDOID_SAMPLE_DRAWS 4  // Weighted draws per sample slot before the rest is drawn among distinct structures
+
+enum { FORMAT_MATRIX, FORMAT_CONDENSED, FORMAT_BINARY };
+enum { PHASE_READ, PHASE_DEDUP, PHASE_PARSE, PHASE_DISTANCE, PHASE_OUTPUT, NUM_PHASES };
+static const char* const phase_names[NUM_PHASES] = {"read", "dedup", "parse_tree_info", "distance", "output"};
+
+// Input set loaded from a binary index file (--index)
+typedef struct StructureIndex {
+    void* map;
+    size_t map_size;
+    TreeInfo* trees;      // Headers pointing into the mapping, two per structure
+    TreeInfo** ti_array;
+    int* rep;
+    int num_structures;
+    int num_unique;
+    int max_nodes;
+    uint64_t input_hash;
+} StructureIndex;
+
+// Vantage-point tree over the representatives of a structure set, as
+// arrays over tree positions. The subtree at position p has its vantage
+// point at p, its inner subtree at p + 1 .. split[p] - 1 and its outer
+// subtree from split[p] to the end of p's subtree; each child records the
+// range of distances from the vantage point to its members
+typedef struct VPTree {
+    int num_points;
+    int32_t* point;     // Representative at each position
+    int32_t* split;
+    int32_t* inner_min;
+    int32_t* inner_max;
+    int32_t* outer_min;
+    int32_t* outer_max;
+} VPTree;
+
+// Distances from every distinct structure to recent medoids, one column
+// per medoid, evicting the least recently used column. Entries >= 0 are
+// exact distances; a negative entry -b means the distance is at least b
+typedef struct MedoidCache {
+    int capacity;        // Columns; at least one
+    int num_points;
+    int32_t* medoid;     // Medoid of each column, -1 if unused
+    int32_t* columns;
+    long long* last_used;
+    long long clock;
+} MedoidCache;
+
+// Upper triangle (i < j) of a symmetric distance matrix in condensed
+// (scipy pdist) order, stored as uint16_t or uint32_t
+typedef struct Triangle {
+    void* data;
+    int n;
+    int dtype_size;
+    void* map;       // Whole file mapping when backed by a binary output file
+    size_t map_size;
+} Triangle;
+
+// Buffered text output that bypasses printf for large matrices
+typedef struct TextWriter {
+    FILE* out;
+    size_t len;
+    char buf[1 << 16];
+} TextWriter;
+
+// Progress record for a memory-mapped run, persisted next to the output
+// file as <output>.ckpt so an interrupted run can be resumed
+typedef struct Checkpoint {
+    char* path;
+    unsigned char* done; // One flag per work unit (tile, indexed by Tile::id)
+    int num_units;
+    int n;
+    int dtype_size;
+    uint64_t input_hash;
+    double interval;     // Seconds between checkpoint writes
+    double last_write;
+} Checkpoint;
+
+// Block of representative pairs, the scheduling and checkpoint unit of
+// full-matrix mode
+typedef struct Tile {
+    int id;          // Position in canonical (row-major) tile order
+    int row_block;   // Blocks of tile_size representatives
+    int col_block;
+    int64_t pairs;
+    int64_t cost;    // Estimated DP subproblems
+} Tile;
+
+typedef struct Neighbor {
+    int index;
+    int distance;
+} Neighbor;
+
+typedef struct LabelBucket {
+    int num_pairs;
+    int num_unpaired;
+    int start; // Range in the bucket-ordered representative list
+    int end;
+} LabelBucket;
+
+// One range (radius >= 0) or k-nearest-neighbour query in a VPTree
+typedef struct VPSearch {
+    const VPTree* tree;
+    TreeInfo** ti_array;
+    const int* member_start; // Structures of each representative
+    const int* members;
+    const TreeInfo* query;
+    Workspace* ws;
+    int radius;
+    int knn;
+    Neighbor* found;         // Range: all matches; k-NN: heap of the best knn
+    int count;
+    int capacity;
+    long long computed;      // Distance computations run
+} VPSearch;
+
+// Work counters of one thread, padded so that the counters of different
+// threads never share a cache line
+typedef struct ThreadStats {
+    WorkCounters work;
+    char padding[64];
+} ThreadStats;
+
+// Run statistics for --stats: wall time per phase and the work counters of
+// every thread, reported as one JSON object per line
+typedef struct RunStats {
+    FILE* out;
+    const char* mode;
+    int num_structures;
+    int num_unique;
+    double start;
+    double phase_seconds[NUM_PHASES];
+    int phase;           // Running phase, or -1
+    double phase_start;
+    ThreadStats* threads;
+    int num_threads;
+    int percentage;      // Progress of the distance phase, -1 before the first report
+    double interval;     // Seconds between intermediate reports, 0 for none
+    double next_report;
+} RunStats;
+
+// Progress of one computation, shown on standard error
+typedef struct Progress {
+    int last_percentage;
+    double start;
+} Progress;
+
+// Shared by all threads when --cache-size is given, NULL otherwise
+static SubtreeCache* subtree_cache = NULL;
+// Set by --stats, NULL otherwise
+static RunStats* run_stats = NULL;
 
 // Function declarations
-Node* parse_dot_bracket(const char* db);
-void free_node(Node* node);
-void postorder_traversal(Node* node, Node** list, int* index);
-int find_leftmost_index(Node* node);
-void collect_keyroots(Node* node, Node* parent, int is_first_child, int* keyroots, int* index);
-TreeInfo* compute_tree_info(Node* root);
-void free_tree_info(TreeInfo* ti);
-int tree_edit_dist(TreeInfo* t1, TreeInfo* t2);
-void fill_tree_edit_matrix(TreeInfo* t1, TreeInfo* t2, int** treedist);
-void forest_dist(int i, int j, TreeInfo* t1, TreeInfo* t2, int** treedist);
-int cost_insert(char label);
-int cost_delete(char label);
-int cost_relabel(char label1, char label2);
-int min(int a, int b);
-
-static int compare_int(const void *a, const void *b) {
-    int ia = *(const int*)a;
-    int ib = *(const int*)b;
-    return ia - ib;
-}
-
-Node* parse_dot_bracket(const char* db) {
-    int len = strlen(db);
-    Node* root = malloc(sizeof(Node));
-    if (!root) {
-        fprintf(stderr, "Memory allocation failed for root node\n");
-        exit(1);
-    }
-    root->label = 'R';
-    root->children = NULL;
-    root->num_children = 0;
-    root->index = -1;
-    root->i = 0;
-    root->j = len - 1;
-
-    int* stack = malloc(sizeof(int) * len);
-    if (!stack) {
-        fprintf(stderr, "Memory allocation failed for stack\n");
-        exit(1);
-    }
-    int stack_size = 0;
-    int* parent_stack = malloc(sizeof(int) * len);
-    if (!parent_stack) {
-        fprintf(stderr, "Memory allocation failed for parent stack\n");
-        exit(1);
-    }
-    int parent_stack_size = 0;
-    parent_stack[parent_stack_size] = -1; // root has no parent
-    parent_stack_size++;
-
-    Node** nodes = malloc(sizeof(Node*) * (len + 1));
-    if (!nodes) {
-        fprintf(stderr, "Memory allocation failed for nodes array\n");
-        exit(1);
-    }
-    int node_count = 0;
-
-    int open_count = 0, close_count = 0;
-    for (int i = 0; i < len; i++) {
-        char c = db[i];
-        if (c == '.') {
-            Node* new_node = malloc(sizeof(Node));
-            if (!new_node) {
-                fprintf(stderr, "Memory allocation failed for node\n");
-                exit(1);
-            }
-            new_node->label = 'U';
-            new_node->children = NULL;
-            new_node->num_children = 0;
-            new_node->index = -1;
-            new_node->i = i;
-            new_node->j = i;
-            nodes[node_count] = new_node;
-            node_count++;
-            int parent_idx = parent_stack[parent_stack_size - 1];
-            if (parent_idx == -1) {
-                root->children = realloc(root->children, sizeof(Node*) * (root->num_children + 1));
-                root->children[root->num_children] = new_node;
-                root->num_children++;
-            } else {
-                Node* parent = nodes[parent_idx];
-                parent->children = realloc(parent->children, sizeof(Node*) * (parent->num_children + 1));
-                parent->children[parent->num_children] = new_node;
-                parent->num_children++;
-            }
-        } else if (c == '(') {
-            open_count++;
-            Node* new_node = malloc(sizeof(Node));
-            if (!new_node) {
-                fprintf(stderr, "Memory allocation failed for node\n");
-                exit(1);
-            }
-            new_node->label = 'P';
-            new_node->children = NULL;
-            new_node->num_children = 0;
-            new_node->index = -1;
-            new_node->i = i;
-            new_node->j = -1;
-            nodes[node_count] = new_node;
-            int parent_idx = parent_stack[parent_stack_size - 1];
-            if (parent_idx == -1) {
-                root->children = realloc(root->children, sizeof(Node*) * (root->num_children + 1));
-                root->children[root->num_children] = new_node;
-                root->num_children++;
-            } else {
-                Node* parent = nodes[parent_idx];
-                parent->children = realloc(parent->children, sizeof(Node*) * (parent->num_children + 1));
-                parent->children[parent->num_children] = new_node;
-                parent->num_children++;
-            }
-            stack[stack_size] = node_count;
-            stack_size++;
-            parent_stack[parent_stack_size] = node_count;
-            parent_stack_size++;
-            node_count++;
-        } else if (c == ')') {
-            close_count++;
-            if (stack_size == 0) {
-                fprintf(stderr, "Unmatched closing parenthesis in %s at position %d\n", db, i);
-                exit(1);
-            }
-            stack_size--;
-            int node_idx = stack[stack_size];
-            nodes[node_idx]->j = i;
-            parent_stack_size--;
-        } else {
-            fprintf(stderr, "Invalid character '%c' in %s at position %d\n", c, db, i);
-            exit(1);
-        }
-    }
-    if (open_count != close_count) {
-        fprintf(stderr, "Unbalanced parentheses in %s\n", db);
-        exit(1);
-    }
-    if (stack_size != 0) {
-        fprintf(stderr, "Unclosed parentheses in %s\n", db);
+Workspace* create_thread_workspace(int max_nodes);
+Workspace** create_thread_pool(int max_nodes, int count);
+int pair_distance(TreeInfo* t1, TreeInfo* t2, Workspace* ws, Workspace** pool, int pool_size);
+void report_subtree_cache(SubtreeCache* cache);
+RunStats* create_run_stats(FILE* out, double interval, int num_threads);
+void stats_phase(RunStats* stats, int phase);
+void stats_output_time(RunStats* stats, double seconds);
+void write_run_stats(RunStats* stats, int final);
+void finish_run_stats(RunStats* stats);
+Progress start_progress(void);
+void report_progress(Progress* progress, int percentage);
+uint64_t hash_structures(char** structures, int num_structures);
+uint64_t hash_string(const char* s);
+int find_duplicates(char** structures, int num_structures, int* rep);
+Triangle* create_triangle(int n, int dtype_size);
+Triangle* create_mapped_triangle(const char* path, int n, int dtype_size);
+Triangle* open_mapped_triangle(const char* path, int n, int dtype_size);
+Triangle* open_extended_triangle(const char* path, const char* output_path, char** structures, int num_structures, int* num_old);
+void free_triangle(Triangle* tri);
+void writer_flush(TextWriter* w);
+void writer_put_char(TextWriter* w, char c);
+void writer_put_int(TextWriter* w, int value);
+void fill_binary_header(uint8_t* header, int n, int dtype_size, uint64_t input_hash);
+void write_binary_header(FILE* out, int n, int dtype_size, uint64_t input_hash);
+void write_binary_values(FILE* out, const void* data, size_t count, int dtype_size);
+void write_binary_ints(FILE* out, const int* values, size_t count, int dtype_size);
+void write_row(TextWriter* w, const int* row, int i, int n, int format, int dtype_size);
+void write_triangle(TextWriter* w, Triangle* tri, int format, uint64_t input_hash);
+void write_edge(TextWriter* w, int i, int j, int d);
+void heap_offer(Neighbor* heap, int* size, int capacity, int index, int distance);
+int group_by_label_counts(TreeInfo** ti_array, const int* rep, int n, int* order, LabelBucket** buckets_out);
+Checkpoint* create_checkpoint(const char* output_path, int n, int dtype_size, uint64_t input_hash, int num_units, double interval);
+int load_checkpoint(Checkpoint* ck);
+void save_checkpoint(Checkpoint* ck, Triangle* tri);
+void mark_unit_done(Checkpoint* ck, Triangle* tri, int unit);
+void free_checkpoint(Checkpoint* ck);
+void fill_duplicate_cells(Triangle* tri, const int* rep);
+int64_t tree_cost(const TreeInfo* ti);
+Tile* plan_tiles(TreeInfo** ti_array, const int* reps, int num_reps, int tile_size, int* num_tiles);
+void write_structure_index(const char* path, TreeInfo** ti_array, const int* rep, int n, uint64_t input_hash);
+StructureIndex* load_structure_index(const char* path, int algorithm);
+void free_structure_index(StructureIndex* index);
+void free_input_set(char** structures, TreeInfo** ti_array, int* rep, int num_structures, StructureIndex* index);
+VPTree* create_vptree(int num_points);
+void free_vptree(VPTree* tree);
+VPTree* build_vptree(TreeInfo** ti_array, const int* rep, int n, int num_unique, int max_nodes, int num_threads);
+void write_vptree(const char* path, const VPTree* tree, int n, uint64_t input_hash);
+VPTree* load_vptree(const char* path, const int* rep, int n, uint64_t input_hash);
+void vptree_search(VPSearch* search, int p, int end);
+char** read_query_set(const char* path, int algorithm, int* num_queries, int* num_unique_queries, int** query_rep,
+                      TreeInfo*** query_ti, int* max_nodes);
+uint64_t sample_random(uint64_t* state);
+MedoidCache* create_medoid_cache(size_t budget_bytes, int num_points);
+void free_medoid_cache(MedoidCache* cache);
+int32_t* medoid_cache_column(MedoidCache* cache, int medoid, int* cached);
+void pam_nearest(const int* dist, int s, const int* medoids, int k, int* near, int* d_near, int* d_second);
+void pam_build(const int* dist, const int* weight, int s, int k, int* medoids);
+int64_t pam_swap(const int* dist, const int* weight, int s, int k, int* medoids, int num_threads);
+int64_t assign_to_medoids(TreeInfo** ti_array, const int* points, const int* weight, int num_points, const int* medoids, int k,
+                          MedoidCache* cache, Workspace** pool, int pool_size, int* nearest, int* nearest_dist, long long* computed);
+int* assign_shards(const Tile* tiles, int num_tiles, int num_shards);
+void write_shard_header(FILE* out, int n, int dtype_size, uint64_t input_hash, int shard, int num_shards,
+                        int tile_size, int num_unique, int num_tiles, int shard_tiles, const int* rep);
+void write_shard_tile(FILE* out, const Tile* tile, const int* values, int dtype_size);
+int merge_shards(int argc, char* argv[]);
+char** read_structures(FILE* in, int* num_structures);
+void free_structures(char** structures, int num_structures);
+TreeInfo** build_tree_infos(char** structures, int num_structures, const int* rep, int algorithm, int* max_nodes);
+
+// The engine reports allocation failures instead of exiting; the command
+// line tool cannot continue without its workspaces. With --stats, the
+// workspaces count into the calling thread's (or pool slot's) counters
+Workspace* create_thread_workspace(int max_nodes) {
+    Workspace* ws = create_workspace(max_nodes, subtree_cache);
+    if (!ws) {
+        fprintf(stderr, "Memory allocation failed for workspace\n");
         exit(1);
     }
-    free(stack);
-    free(parent_stack);
-    free(nodes);
-    return root;
+    if (run_stats) ws->counters = &run_stats->threads[omp_get_thread_num()].work;
+    return ws;
 }
 
-void free_node(Node* node) {
-    if (!node) return;
-    for (int i = 0; i < node->num_children; i++) {
-        free_node(node->children[i]);
+Workspace** create_thread_pool(int max_nodes, int count) {
+    Workspace** pool = create_workspace_pool(max_nodes, count, subtree_cache);
+    if (!pool) {
+        fprintf(stderr, "Memory allocation failed for workspace\n");
+        exit(1);
     }
-    free(node->children);
-    free(node);
-}
-
-void postorder_traversal(Node* node, Node** list, int* index) {
-    if (!node) return;
-    for (int i = 0; i < node->num_children; i++) {
-        postorder_traversal(node->children[i], list, index);
+    if (run_stats) {
+        for (int t = 0; t < count; t++) {
+            pool[t]->counters = &run_stats->threads[t].work;
+        }
     }
-    list[*index] = node;
-    node->index = *index;
-    (*index)++;
+    return pool;
 }
 
-int find_leftmost_index(Node* node) {
-    if (!node) return -1;
-    if (node->num_children == 0) {
-        return node->index;
+// Distance of one pair, split over the threads of pool if one is given
+int pair_distance(TreeInfo* t1, TreeInfo* t2, Workspace* ws, Workspace** pool, int pool_size) {
+    if (!pool) return tree_edit_dist(t1, t2, ws);
+    int ted = tree_edit_dist_parallel(t1, t2, pool, pool_size);
+    if (ted < 0) {
+        fprintf(stderr, "Memory allocation failed for keyroot wavefronts\n");
+        exit(1);
     }
-    return find_leftmost_index(node->children[0]);
+    return ted;
 }
 
-void collect_keyroots(Node* node, Node* parent, int is_first_child, int* keyroots, int* index) {
-    if (!node) return;
-    if (parent == NULL || !is_first_child) {
-        keyroots[*index] = node->index;
-        (*index)++;
-    }
-    for (int i = 0; i < node->num_children; i++) {
-        collect_keyroots(node->children[i], node, i == 0, keyroots, index);
-    }
+void report_subtree_cache(SubtreeCache* cache) {
+    long long hits, misses;
+    size_t bytes;
+    rnated_cache_stats(cache, &hits, &misses, &bytes);
+    long long lookups = hits + misses;
+    fprintf(stderr, "Subtree cache: %lld hits, %lld misses (%.1f%% hit rate), %.1f MB used\n",
+            hits, misses, lookups > 0 ? 100.0 * hits / lookups : 0.0, bytes / 1048576.0);
 }
 
-TreeInfo* compute_tree_info(Node* root) {
-    TreeInfo* ti = malloc(sizeof(TreeInfo));
-    if (!ti) {
-        fprintf(stderr, "Memory allocation failed for TreeInfo\n");
+RunStats* create_run_stats(FILE* out, double interval, int num_threads) {
+    RunStats* stats = calloc(1, sizeof(RunStats));
+    if (!stats) {
+        fprintf(stderr, "Memory allocation failed for run statistics\n");
         exit(1);
     }
-    ti->root = root;
-    int max_nodes = 1000; // Adjust based on input size
-    ti->postorder = malloc(sizeof(Node*) * max_nodes);
-    if (!ti->postorder) {
-        fprintf(stderr, "Memory allocation failed for postorder\n");
+    stats->threads = calloc(num_threads, sizeof(ThreadStats));
+    if (!stats->threads) {
+        fprintf(stderr, "Memory allocation failed for run statistics\n");
         exit(1);
     }
-    int index = 0;
-    postorder_traversal(root, ti->postorder, &index);
-    ti->postorder_size = index;
-    ti->postorder = realloc(ti->postorder, sizeof(Node*) * ti->postorder_size);
-    if (!ti->postorder && ti->postorder_size > 0) {
-        fprintf(stderr, "Memory reallocation failed for postorder\n");
-        exit(1);
+    for (int t = 0; t < num_threads; t++) {
+        stats->threads[t].work.timed = 1;
     }
-    ti->leftmost = malloc(sizeof(int) * ti->postorder_size);
-    if (!ti->leftmost) {
-        fprintf(stderr, "Memory allocation failed for leftmost\n");
-        exit(1);
+    stats->out = out;
+    stats->mode = "full";
+    stats->num_threads = num_threads;
+    stats->start = omp_get_wtime();
+    stats->phase = -1;
+    stats->percentage = -1;
+    stats->interval = interval;
+    stats->next_report = stats->start + interval;
+    return stats;
+}
+
+// Ends the running phase and starts the given one (-1 for none); phases
+// entered more than once accumulate
+void stats_phase(RunStats* stats, int phase) {
+    if (!stats) return;
+    double now = omp_get_wtime();
+    if (stats->phase >= 0) stats->phase_seconds[stats->phase] += now - stats->phase_start;
+    stats->phase = phase;
+    stats->phase_start = now;
+}
+
+// Output written from within the distance phase while all threads wait for
+// it, as in the streaming modes
+void stats_output_time(RunStats* stats, double seconds) {
+    if (!stats || stats->phase != PHASE_DISTANCE) return;
+    stats->phase_seconds[PHASE_OUTPUT] += seconds;
+    stats->phase_seconds[PHASE_DISTANCE] -= seconds;
+}
+
+// Counters are read with relaxed loads while the threads keep working, so
+// an intermediate report is a consistent-enough snapshot, not an exact one
+void write_run_stats(RunStats* stats, int final) {
+    double now = omp_get_wtime();
+    double phases[NUM_PHASES];
+    memcpy(phases, stats->phase_seconds, sizeof(phases));
+    if (stats->phase >= 0) phases[stats->phase] += now - stats->phase_start;
+
+    int64_t pairs = 0, keyroot_pairs = 0, dp_cells = 0, cache_hits = 0;
+    double busy_total = 0, busy_max = 0;
+    for (int t = 0; t < stats->num_threads; t++) {
+        WorkCounters* work = &stats->threads[t].work;
+        double busy = counter_read(&work->busy_ns) / 1e9;
+        pairs += counter_read(&work->pairs);
+        keyroot_pairs += counter_read(&work->keyroot_pairs);
+        dp_cells += counter_read(&work->dp_cells);
+        cache_hits += counter_read(&work->cache_hits);
+        busy_total += busy;
+        if (busy > busy_max) busy_max = busy;
     }
-    for (int i = 0; i < ti->postorder_size; i++) {
-        ti->leftmost[i] = find_leftmost_index(ti->postorder[i]);
+    struct rusage usage;
+    double peak_mb = 0;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+#ifdef __APPLE__
+        peak_mb = usage.ru_maxrss / 1048576.0; // Bytes on macOS
+#else
+        peak_mb = usage.ru_maxrss / 1024.0;    // Kilobytes elsewhere
+#endif
     }
-    ti->keyroots = malloc(sizeof(int) * ti->postorder_size);
-    if (!ti->keyroots) {
-        fprintf(stderr, "Memory allocation failed for keyroots\n");
-        exit(1);
+    int percentage = __atomic_load_n(&stats->percentage, __ATOMIC_RELAXED);
+    double distance_seconds = phases[PHASE_DISTANCE];
+
+    FILE* out = stats->out;
+    fprintf(out, "{\"final\": %s, \"mode\": \"%s\", \"elapsed_seconds\": %.3f, \"threads\": %d, "
+                 "\"structures\": %d, \"unique_structures\": %d, \"phases\": {",
+            final ? "true" : "false", stats->mode, now - stats->start, stats->num_threads,
+            stats->num_structures, stats->num_unique);
+    for (int p = 0; p < NUM_PHASES; p++) {
+        fprintf(out, "%s\"%s\": %.3f", p ? ", " : "", phase_names[p], phases[p]);
     }
-    int kr_index = 0;
-    collect_keyroots(root, NULL, 0, ti->keyroots, &kr_index);
-    ti->num_keyroots = kr_index;
-    ti->keyroots = realloc(ti->keyroots, sizeof(int) * ti->num_keyroots);
-    if (!ti->keyroots && ti->num_keyroots > 0) {
-        fprintf(stderr, "Memory reallocation failed for keyroots\n");
-        exit(1);
+    fprintf(out, "}, \"progress\": %.2f, \"eta_seconds\": ", percentage >= 0 ? percentage / 100.0 : 0.0);
+    if (percentage > 0) {
+        fprintf(out, "%.1f", distance_seconds * (100 - percentage) / percentage);
+    } else {
+        fprintf(out, "null");
+    }
+    fprintf(out, ", \"pairs\": %lld, \"pairs_per_second\": %.1f, \"keyroot_pairs\": %lld, \"dp_cells\": %lld, "
+                 "\"cache_hits\": %lld, \"thread_busy_seconds\": [",
+            (long long)pairs, distance_seconds > 0 ? pairs / distance_seconds : 0.0,
+            (long long)keyroot_pairs, (long long)dp_cells, (long long)cache_hits);
+    for (int t = 0; t < stats->num_threads; t++) {
+        fprintf(out, "%s%.3f", t ? ", " : "", counter_read(&stats->threads[t].work.busy_ns) / 1e9);
+    }
+    fprintf(out, "], \"thread_pairs\": [");
+    for (int t = 0; t < stats->num_threads; t++) {
+        fprintf(out, "%s%lld", t ? ", " : "", (long long)counter_read(&stats->threads[t].work.pairs));
     }
-    qsort(ti->keyroots, ti->num_keyroots, sizeof(int), compare_int);
-    return ti;
+    // Busiest thread relative to the average: 1 is perfectly balanced
+    double busy_mean = busy_total / stats->num_threads;
+    fprintf(out, "], \"load_imbalance\": %.3f, \"peak_rss_mb\": %.1f}\n",
+            busy_mean > 0 ? busy_max / busy_mean : 1.0, peak_mb);
+    fflush(out);
 }
 
-void free_tree_info(TreeInfo* ti) {
-    if (!ti) return;
-    free(ti->postorder);
-    free(ti->leftmost);
-    free(ti->keyroots);
-    free(ti);
+// Final report at exit
+void finish_run_stats(RunStats* stats) {
+    if (!stats) return;
+    stats_phase(stats, -1);
+    stats->percentage = 100;
+    write_run_stats(stats, 1);
+    if (stats->out != stderr) fclose(stats->out);
+    free(stats->threads);
+    free(stats);
 }
 
-int cost_insert(char label) {
-    return (label == 'P') ? 2 : 1;
+Progress start_progress(void) {
+    Progress progress = {-1, omp_get_wtime()};
+    return progress;
+}
+
+// Shows the percentage and the estimated remaining time. Threads report
+// without locking: only the one that raises last_percentage prints. With
+// --stats, this also emits the intermediate reports
+void report_progress(Progress* progress, int percentage) {
+    if (run_stats) {
+        int seen = __atomic_load_n(&run_stats->percentage, __ATOMIC_RELAXED);
+        while (percentage > seen &&
+               !__atomic_compare_exchange_n(&run_stats->percentage, &seen, percentage, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        }
+        if (run_stats->interval > 0) {
+            double now = omp_get_wtime();
+            double next;
+            __atomic_load(&run_stats->next_report, &next, __ATOMIC_RELAXED);
+            if (now >= next) {
+                #pragma omp critical(run_stats)
+                {
+                    if (now >= run_stats->next_report) {
+                        double next_report = now + run_stats->interval;
+                        __atomic_store(&run_stats->next_report, &next_report, __ATOMIC_RELAXED);
+                        write_run_stats(run_stats, 0);
+                    }
+                }
+            }
+        }
+    }
+    int last = __atomic_load_n(&progress->last_percentage, __ATOMIC_RELAXED);
+    while (percentage > last) {
+        if (__atomic_compare_exchange_n(&progress->last_percentage, &last, percentage, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            if (percentage > 0 && percentage < 100) {
+                int eta = (int)((omp_get_wtime() - progress->start) * (100 - percentage) / percentage + 0.5);
+                fprintf(stderr, "\rProgress: %d%% (ETA %d:%02d:%02d)", percentage, eta / 3600, eta / 60 % 60, eta % 60);
+            } else {
+                fprintf(stderr, "\rProgress: %d%%                   ", percentage);
+            }
+            fflush(stderr);
+            break;
+        }
+    }
 }
 
-int cost_delete(char label) {
-    return (label == 'P') ? 2 : 1;
+static inline size_t triangle_size(int n) {
+    return n > 1 ? (size_t)n * (n - 1) / 2 : 0;
 }
 
-int cost_relabel(char label1, char label2) {
-    return (label1 == label2) ? 0 : 1;
+// Position of (i, j), i < j, in condensed order
+static inline size_t triangle_index(int n, int i, int j) {
+    return (size_t)i * n - (size_t)i * (i + 1) / 2 + (j - i - 1);
 }
 
-int min(int a, int b) {
-    return a < b ? a : b;
+static inline int get_distance_at(const Triangle* tri, size_t k) {
+    if (tri->dtype_size == 2) return ((const uint16_t*)tri->data)[k];
+    return (int)((const uint32_t*)tri->data)[k];
 }
 
-void forest_dist(int i, int j, TreeInfo* t1, TreeInfo* t2, int** treedist) {
-    int l1 = t1->leftmost[i];
-    int l2 = t2->leftmost[j];
-    int base_d1 = i - l1 + 2;
-    int base_d2 = j - l2 + 2;
-    int** fd = malloc(sizeof(int*) * base_d1);
-    if (!fd) {
-        fprintf(stderr, "Memory allocation failed for forest distance array\n");
-        exit(1);
+static inline int get_distance(const Triangle* tri, int i, int j) {
+    if (i == j) return 0;
+    if (i > j) {
+        int tmp = i;
+        i = j;
+        j = tmp;
     }
-    for (int di = 0; di < base_d1; di++) {
-        fd[di] = malloc(sizeof(int) * base_d2);
-        if (!fd[di]) {
-            fprintf(stderr, "Memory allocation failed for forest distance row\n");
+    return get_distance_at(tri, triangle_index(tri->n, i, j));
+}
+
+static inline void set_distance(Triangle* tri, int i, int j, int d) {
+    size_t k = triangle_index(tri->n, i, j);
+    if (tri->dtype_size == 2) {
+        if (d > UINT16_MAX) {
+            fprintf(stderr, "Distance %d does not fit into uint16, use --dtype uint32\n", d);
             exit(1);
         }
-        for (int dj = 0; dj < base_d2; dj++) {
-            fd[di][dj] = base_d1 + base_d2;
-        }
-    }
-    fd[0][0] = 0;
-    for (int di = 1; di < base_d1; di++) {
-        int idx1 = l1 + di - 1;
-        char label1 = t1->postorder[idx1]->label;
-        fd[di][0] = fd[di - 1][0] + cost_delete(label1);
-    }
-    for (int dj = 1; dj < base_d2; dj++) {
-        int idx2 = l2 + dj - 1;
-        char label2 = t2->postorder[idx2]->label;
-        fd[0][dj] = fd[0][dj - 1] + cost_insert(label2);
-    }
-    for (int di = 1; di < base_d1; di++) {
-        for (int dj = 1; dj < base_d2; dj++) {
-            int idx1 = l1 + di - 1;
-            int idx2 = l2 + dj - 1;
-            char label1 = t1->postorder[idx1]->label;
-            char label2 = t2->postorder[idx2]->label;
-            int cost;
-            if (t1->leftmost[idx1] == l1 && t2->leftmost[idx2] == l2) {
-                int delete_cost = fd[di - 1][dj] + cost_delete(label1);
-                int insert_cost = fd[di][dj - 1] + cost_insert(label2);
-                int relabel_cost = fd[di - 1][dj - 1] + cost_relabel(label1, label2);
-                cost = min(delete_cost, min(insert_cost, relabel_cost));
-                treedist[idx1][idx2] = cost;
-            } else {
-                int delete_cost = fd[di - 1][dj] + cost_delete(label1);
-                int insert_cost = fd[di][dj - 1] + cost_insert(label2);
-                int subtree_cost = fd[t1->leftmost[idx1] - l1][t2->leftmost[idx2] - l2] + treedist[idx1][idx2];
-                cost = min(delete_cost, min(insert_cost, subtree_cost));
-            }
-            fd[di][dj] = cost;
-        }
-    }
-    for (int di = 0; di < base_d1; di++) {
-        free(fd[di]);
+        ((uint16_t*)tri->data)[k] = (uint16_t)d;
+    } else {
+        ((uint32_t*)tri->data)[k] = (uint32_t)d;
     }
-    free(fd);
 }
 
-void fill_tree_edit_matrix(TreeInfo* t1, TreeInfo* t2, int** treedist) {
-    for (int ki = 0; ki < t1->num_keyroots; ki++) {
-        int i = t1->keyroots[ki];
-        for (int kj = 0; kj < t2->num_keyroots; kj++) {
-            int j = t2->keyroots[kj];
-            forest_dist(i, j, t1, t2, treedist);
+uint64_t hash_structures(char** structures, int num_structures) {
+    // FNV-1a over all structures, each terminated by a newline
+    uint64_t h = 14695981039346656037ULL;
+    for (int i = 0; i < num_structures; i++) {
+        for (const char* p = structures[i]; *p; p++) {
+            h ^= (unsigned char)*p;
+            h *= 1099511628211ULL;
         }
+        h ^= '\n';
+        h *= 1099511628211ULL;
     }
+    return h;
 }
 
-int tree_edit_dist(TreeInfo* t1, TreeInfo* t2) {
-    int m = t1->postorder_size;
-    int n = t2->postorder_size;
-    int** treedist = malloc(sizeof(int*) * m);
-    if (!treedist) {
-        fprintf(stderr, "Memory allocation failed for tree edit distance matrix\n");
+uint64_t hash_string(const char* s) {
+    uint64_t h = 14695981039346656037ULL;
+    for (; *s; s++) {
+        h ^= (unsigned char)*s;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// Maps every structure to the first structure with an identical dot-bracket
+// string (rep[i] == i for those first occurrences); returns how many
+// distinct structures there are
+int find_duplicates(char** structures, int num_structures, int* rep) {
+    size_t table_size = 16;
+    while (table_size < (size_t)num_structures * 2) table_size *= 2;
+    int* table = malloc(table_size * sizeof(int));
+    uint64_t* hashes = malloc((num_structures > 0 ? num_structures : 1) * sizeof(uint64_t));
+    if (!table || !hashes) {
+        fprintf(stderr, "Memory allocation failed for duplicate table\n");
         exit(1);
     }
-    for (int i = 0; i < m; i++) {
-        treedist[i] = malloc(sizeof(int) * n);
-        if (!treedist[i]) {
-            fprintf(stderr, "Memory allocation failed for tree edit distance row\n");
-            exit(1);
+    for (size_t k = 0; k < table_size; k++) table[k] = -1;
+    // Hashing touches every input byte, so it runs in parallel; inserting
+    // stays sequential to keep the first occurrence as representative
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < num_structures; i++) {
+        hashes[i] = hash_string(structures[i]);
+    }
+    int num_unique = 0;
+    for (int i = 0; i < num_structures; i++) {
+        size_t slot = hashes[i] & (table_size - 1);
+        while (table[slot] >= 0 && strcmp(structures[table[slot]], structures[i]) != 0) {
+            slot = (slot + 1) & (table_size - 1);
         }
-        for (int j = 0; j < n; j++) {
-            treedist[i][j] = m + n;
+        if (table[slot] < 0) {
+            table[slot] = i;
+            num_unique++;
         }
+        rep[i] = table[slot];
     }
-    fill_tree_edit_matrix(t1, t2, treedist);
-    int dist = treedist[m-1][n-1];
-    for (int i = 0; i < m; i++) {
-        free(treedist[i]);
+    free(hashes);
+    free(table);
+    return num_unique;
+}
+
+static int host_is_little_endian(void) {
+    uint16_t probe = 1;
+    return *(uint8_t*)&probe == 1;
+}
+
+static void put_le(uint8_t* dst, uint64_t value, int bytes) {
+    for (int b = 0; b < bytes; b++) {
+        dst[b] = (uint8_t)(value >> (8 * b));
     }
-    free(treedist);
-    return dist;
 }
 
-int main(int argc, char* argv[]) {
-    int opt;
-    int num_threads = omp_get_max_threads();
-    int row_wise = 0;  // Default to full matrix mode
-    int first_only = 0; // New option to compare only the first structure
+static uint64_t get_le(const uint8_t* src, int bytes) {
+    uint64_t value = 0;
+    for (int b = bytes - 1; b >= 0; b--) {
+        value = (value << 8) | src[b];
+    }
+    return value;
+}
 
-    struct option long_options[] = {
-        {"help", no_argument, 0, 'h'},
-        {"version", no_argument, 0, 'v'},
-        {"threads", required_argument, 0, 't'},
-        {"row-wise", no_argument, 0, 'r'},
-        {"first-only", no_argument, 0, 'f'}, // New option
-        {0, 0, 0, 0}
-    };
+void fill_binary_header(uint8_t* header, int n, int dtype_size, uint64_t input_hash) {
+    memset(header, 0, BINARY_HEADER_SIZE);
+    memcpy(header, BINARY_MAGIC, 8);
+    put_le(header + 8, BINARY_VERSION, 4);
+    put_le(header + 12, dtype_size, 4);
+    put_le(header + 16, (uint64_t)n, 8);
+    put_le(header + 24, input_hash, 8);
+}
 
-    while ((opt = getopt_long(argc, argv, "hvt:rf", long_options, NULL)) != -1) {
-        switch (opt) {
-            case 'h':
-                printf("Usage: %s [options]\n", argv[0]);
-                printf("Options:\n");
-                printf("  --help, -h         Display this help message\n");
-                printf("  --version, -v      Display version information\n");
-                printf("  --threads, -t      Set number of threads (default: %d)\n", num_threads);
-                printf("  --row-wise, -r     Output the distance matrix row by row (memory-efficient)\n");
-                printf("  --first-only, -f   Compute distances only for the first structure against all others\n");
-                printf("\nThe program reads RNA secondary structures in dot-bracket notation\n");
-                printf("from standard input, one per line, and outputs either a distance matrix\n");
-                printf("or distances for the first structure based on tree edit distance.\n");
-                return 0;
-            case 'v':
-                printf("Version: %s\n", VERSION);
-                return 0;
-            case 't':
-                num_threads = atoi(optarg);
-                if (num_threads <= 0) {
-                    fprintf(stderr, "Invalid number of threads: %s\n", optarg);
-                    return 1;
-                }
-                break;
-            case 'r':
-                row_wise = 1;
-                break;
-            case 'f':
-                first_only = 1;
-                break;
-            default:
-                fprintf(stderr, "Invalid option. Use --help for usage information.\n");
-                return 1;
+Triangle* create_triangle(int n, int dtype_size) {
+    Triangle* tri = malloc(sizeof(Triangle));
+    if (!tri) {
+        fprintf(stderr, "Memory allocation failed for distance triangle\n");
+        exit(1);
+    }
+    tri->n = n;
+    tri->dtype_size = dtype_size;
+    tri->map = NULL;
+    tri->map_size = 0;
+    size_t count = triangle_size(n);
+    tri->data = malloc(count > 0 ? count * dtype_size : 1);
+    if (!tri->data) {
+        fprintf(stderr, "Memory allocation failed for distance triangle\n");
+        exit(1);
+    }
+    return tri;
+}
+
+// Maps a binary output file holding the condensed triangle for n structures.
+// A new file is created at its final size; an existing one (resume) must
+// have exactly that size and is checked against its checkpoint. The header
+// stays cleared until the caller writes it after the last value, so an
+// interrupted run cannot be mistaken for a complete matrix
+static Triangle* map_triangle_file(const char* path, int n, int dtype_size, int existing) {
+    if (!host_is_little_endian()) {
+        fprintf(stderr, "Memory-mapped binary output requires a little-endian host\n");
+        exit(1);
+    }
+    Triangle* tri = malloc(sizeof(Triangle));
+    if (!tri) {
+        fprintf(stderr, "Memory allocation failed for distance triangle\n");
+        exit(1);
+    }
+    tri->n = n;
+    tri->dtype_size = dtype_size;
+    tri->map_size = BINARY_HEADER_SIZE + triangle_size(n) * dtype_size;
+    int fd = open(path, existing ? O_RDWR : O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to %s output file %s\n", existing ? "open" : "create", path);
+        exit(1);
+    }
+    if (existing) {
+        struct stat st;
+        if (fstat(fd, &st) != 0 || (size_t)st.st_size != tri->map_size) {
+            fprintf(stderr, "Output file %s does not have the size expected for %d structures\n", path, n);
+            exit(1);
         }
+    } else if (ftruncate(fd, (off_t)tri->map_size) != 0) {
+        fprintf(stderr, "Failed to resize output file %s\n", path);
+        exit(1);
+    }
+    tri->map = mmap(NULL, tri->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (tri->map == MAP_FAILED) {
+        fprintf(stderr, "Failed to map output file %s\n", path);
+        exit(1);
     }
+    close(fd);
+    memset(tri->map, 0, BINARY_HEADER_SIZE);
+    tri->data = (uint8_t*)tri->map + BINARY_HEADER_SIZE;
+    return tri;
+}
 
-    omp_set_num_threads(num_threads);
+// Creates the binary output file at its final size and maps it, so workers
+// write distances straight into the page cache and the kernel can write
+// finished regions back to disk instead of holding the matrix in RAM
+Triangle* create_mapped_triangle(const char* path, int n, int dtype_size) {
+    return map_triangle_file(path, n, dtype_size, 0);
+}
 
-    char** structures = malloc(INITIAL_CAPACITY * sizeof(char*));
-    if (!structures) {
-        fprintf(stderr, "Memory allocation failed for structures\n");
-        return 1;
+Triangle* open_mapped_triangle(const char* path, int n, int dtype_size) {
+    return map_triangle_file(path, n, dtype_size, 1);
+}
+
+// Moves the rows of an n-structure condensed triangle to their positions in
+// a new_n-structure one. Every row moves towards the end, so going from the
+// last row to the first also works when src and dst are the same buffer
+static void move_triangle_rows(uint8_t* dst, const uint8_t* src, int n, int new_n, int dtype_size) {
+    for (int i = n - 2; i > 0; i--) {
+        memmove(dst + triangle_index(new_n, i, i + 1) * dtype_size, src + triangle_index(n, i, i + 1) * dtype_size,
+                (size_t)(n - i - 1) * dtype_size);
     }
-    int capacity = INITIAL_CAPACITY;
-    int num_structures = 0;
-    char line[1024];
+    if (n > 1 && dst != src) memcpy(dst, src, (size_t)(n - 1) * dtype_size);
+}
 
-    while (fgets(line, sizeof(line), stdin) != NULL) {
-        line[strcspn(line, "\n")] = 0;
-        if (strlen(line) == 0) break;
-        if (num_structures >= capacity) {
-            capacity *= 2;
-            structures = realloc(structures, capacity * sizeof(char*));
-            if (!structures) {
-                fprintf(stderr, "Memory reallocation failed for structures\n");
-                return 1;
-            }
+// Maps a binary matrix of the first structures of the input, grown to all
+// num_structures: in place, or as a copy at output_path. Its header must
+// match those structures, and it must not have a checkpoint left by an
+// unfinished run. The old values are moved into the larger
+// triangle and the new cells are left to the caller, which writes the
+// header once they are filled; until then the header is cleared, so an
+// interrupted extension cannot be mistaken for a complete matrix
+Triangle* open_extended_triangle(const char* path, const char* output_path, char** structures, int num_structures, int* num_old) {
+    if (!host_is_little_endian()) {
+        fprintf(stderr, "Memory-mapped binary output requires a little-endian host\n");
+        exit(1);
+    }
+    if (output_path && strcmp(output_path, path) == 0) output_path = NULL;
+    // A checkpoint means the run that produced the matrix never finished
+    char* checkpoint_path = malloc(strlen(path) + sizeof(CHECKPOINT_SUFFIX));
+    if (!checkpoint_path) {
+        fprintf(stderr, "Memory allocation failed for checkpoint\n");
+        exit(1);
+    }
+    sprintf(checkpoint_path, "%s%s", path, CHECKPOINT_SUFFIX);
+    if (access(checkpoint_path, F_OK) == 0) {
+        fprintf(stderr, "Matrix file %s is incomplete (checkpoint %s exists); finish it with --resume first\n", path, checkpoint_path);
+        exit(1);
+    }
+    free(checkpoint_path);
+    int fd = open(path, output_path ? O_RDONLY : O_RDWR);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open matrix file %s\n", path);
+        exit(1);
+    }
+    uint8_t header[BINARY_HEADER_SIZE];
+    struct stat st;
+    if (read(fd, header, BINARY_HEADER_SIZE) != BINARY_HEADER_SIZE || memcmp(header, BINARY_MAGIC, 8) != 0 ||
+        get_le(header + 8, 4) != BINARY_VERSION || fstat(fd, &st) != 0) {
+        fprintf(stderr, "Invalid binary matrix file %s\n", path);
+        exit(1);
+    }
+    int dtype_size = (int)get_le(header + 12, 4);
+    uint64_t stored_n = get_le(header + 16, 8);
+    if ((dtype_size != 2 && dtype_size != 4) || stored_n > (uint64_t)num_structures) {
+        fprintf(stderr, "Matrix file %s holds more structures than the input\n", path);
+        exit(1);
+    }
+    int n = (int)stored_n;
+    size_t old_size = BINARY_HEADER_SIZE + triangle_size(n) * dtype_size;
+    if ((size_t)st.st_size != old_size) {
+        fprintf(stderr, "Matrix file %s does not have the size expected for %d structures\n", path, n);
+        exit(1);
+    }
+    if (get_le(header + 24, 8) != hash_structures(structures, n)) {
+        fprintf(stderr, "Matrix file %s was not produced from the first %d input structures\n", path, n);
+        exit(1);
+    }
+
+    Triangle* tri;
+    if (output_path) {
+        uint8_t* old_map = mmap(NULL, old_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (old_map == MAP_FAILED) {
+            fprintf(stderr, "Failed to map matrix file %s\n", path);
+            exit(1);
         }
-        structures[num_structures] = strdup(line);
-        if (!structures[num_structures]) {
-            fprintf(stderr, "Memory allocation failed for structure string\n");
-            return 1;
+        tri = create_mapped_triangle(output_path, num_structures, dtype_size);
+        move_triangle_rows(tri->data, old_map + BINARY_HEADER_SIZE, n, num_structures, dtype_size);
+        munmap(old_map, old_size);
+    } else {
+        tri = malloc(sizeof(Triangle));
+        if (!tri) {
+            fprintf(stderr, "Memory allocation failed for distance triangle\n");
+            exit(1);
+        }
+        tri->n = num_structures;
+        tri->dtype_size = dtype_size;
+        tri->map_size = BINARY_HEADER_SIZE + triangle_size(num_structures) * dtype_size;
+        if (ftruncate(fd, (off_t)tri->map_size) != 0) {
+            fprintf(stderr, "Failed to resize matrix file %s\n", path);
+            exit(1);
         }
-        num_structures++;
+        tri->map = mmap(NULL, tri->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (tri->map == MAP_FAILED) {
+            fprintf(stderr, "Failed to map matrix file %s\n", path);
+            exit(1);
+        }
+        tri->data = (uint8_t*)tri->map + BINARY_HEADER_SIZE;
+        memset(tri->map, 0, BINARY_HEADER_SIZE);
+        move_triangle_rows(tri->data, tri->data, n, num_structures, dtype_size);
     }
+    close(fd);
+    *num_old = n;
+    return tri;
+}
 
-    if (num_structures == 0) {
-        fprintf(stderr, "No structures provided.\n");
-        free(structures);
-        return 1;
+void free_triangle(Triangle* tri) {
+    if (!tri) return;
+    if (tri->map) {
+        if (msync(tri->map, tri->map_size, MS_SYNC) != 0) {
+            fprintf(stderr, "Failed to flush output file\n");
+            exit(1);
+        }
+        munmap(tri->map, tri->map_size);
+    } else {
+        free(tri->data);
     }
+    free(tri);
+}
 
-    structures = realloc(structures, num_structures * sizeof(char*));
-    if (!structures && num_structures > 0) {
-        fprintf(stderr, "Memory reallocation failed for structures\n");
-        return 1;
+void writer_flush(TextWriter* w) {
+    if (w->len > 0 && fwrite(w->buf, 1, w->len, w->out) != w->len) {
+        fprintf(stderr, "Failed to write output\n");
+        exit(1);
     }
+    w->len = 0;
+}
 
-    Node** trees = malloc(num_structures * sizeof(Node*));
-    if (!trees) {
-        fprintf(stderr, "Memory allocation failed for trees\n");
-        return 1;
+void writer_put_char(TextWriter* w, char c) {
+    if (w->len == sizeof(w->buf)) writer_flush(w);
+    w->buf[w->len++] = c;
+}
+
+void writer_put_int(TextWriter* w, int value) {
+    char digits[12];
+    int count = 0;
+    unsigned int v = value < 0 ? -(unsigned int)value : (unsigned int)value;
+    do {
+        digits[count++] = '0' + v % 10;
+        v /= 10;
+    } while (v > 0);
+    if (value < 0) digits[count++] = '-';
+    if (w->len + count > sizeof(w->buf)) writer_flush(w);
+    while (count > 0) {
+        w->buf[w->len++] = digits[--count];
     }
-    for (int i = 0; i < num_structures; i++) {
-        trees[i] = parse_dot_bracket(structures[i]);
+}
+
+void write_binary_header(FILE* out, int n, int dtype_size, uint64_t input_hash) {
+    uint8_t header[BINARY_HEADER_SIZE];
+    fill_binary_header(header, n, dtype_size, input_hash);
+    if (fwrite(header, 1, BINARY_HEADER_SIZE, out) != BINARY_HEADER_SIZE) {
+        fprintf(stderr, "Failed to write output\n");
+        exit(1);
     }
+}
 
-    TreeInfo** ti_array = malloc(num_structures * sizeof(TreeInfo*));
-    if (!ti_array) {
-        fprintf(stderr, "Memory allocation failed for tree info array\n");
-        return 1;
+void write_binary_values(FILE* out, const void* data, size_t count, int dtype_size) {
+    if (host_is_little_endian()) {
+        if (count > 0 && fwrite(data, dtype_size, count, out) != count) {
+            fprintf(stderr, "Failed to write output\n");
+            exit(1);
+        }
+        return;
     }
-    for (int i = 0; i < num_structures; i++) {
-        ti_array[i] = compute_tree_info(trees[i]);
+    uint8_t chunk[1 << 16];
+    size_t per_chunk = sizeof(chunk) / dtype_size;
+    for (size_t start = 0; start < count; start += per_chunk) {
+        size_t len = count - start < per_chunk ? count - start : per_chunk;
+        for (size_t k = 0; k < len; k++) {
+            uint64_t v = dtype_size == 2 ? ((const uint16_t*)data)[start + k] : ((const uint32_t*)data)[start + k];
+            put_le(chunk + k * dtype_size, v, dtype_size);
+        }
+        if (fwrite(chunk, dtype_size, len, out) != len) {
+            fprintf(stderr, "Failed to write output\n");
+            exit(1);
+        }
     }
+}
 
-    if (first_only) {
-        // Compute distances only for the first structure against all others
-        if (num_structures < 2) {
-            fprintf(stderr, "At least two structures are required for comparison.\n");
-            for (int i = 0; i < num_structures; i++) {
-                free(structures[i]);
-                free_node(trees[i]);
-                free_tree_info(ti_array[i]);
+void write_binary_ints(FILE* out, const int* values, size_t count, int dtype_size) {
+    uint8_t chunk[1 << 16];
+    size_t per_chunk = sizeof(chunk) / dtype_size;
+    for (size_t start = 0; start < count; start += per_chunk) {
+        size_t len = count - start < per_chunk ? count - start : per_chunk;
+        for (size_t k = 0; k < len; k++) {
+            int v = values[start + k];
+            if (dtype_size == 2 && v > UINT16_MAX) {
+                fprintf(stderr, "Distance %d does not fit into uint16, use --dtype uint32\n", v);
+                exit(1);
             }
-            free(structures);
-            free(trees);
-            free(ti_array);
-            return 1;
+            put_le(chunk + k * dtype_size, (uint64_t)v, dtype_size);
         }
+        if (fwrite(chunk, dtype_size, len, out) != len) {
+            fprintf(stderr, "Failed to write output\n");
+            exit(1);
+        }
+    }
+}
 
-        int* distances = malloc((num_structures - 1) * sizeof(int));
-        if (!distances) {
-            fprintf(stderr, "Memory allocation failed for distances array\n");
-            for (int i = 0; i < num_structures; i++) {
-                free(structures[i]);
-                free_node(trees[i]);
-                free_tree_info(ti_array[i]);
-            }
-            free(structures);
-            free(trees);
-            free(ti_array);
-            return 1;
+// Writes one matrix row (given in full, row[i] == 0) in the selected format;
+// condensed and binary output only carry the part right of the diagonal
+void write_row(TextWriter* w, const int* row, int i, int n, int format, int dtype_size) {
+    if (format == FORMAT_BINARY) {
+        writer_flush(w);
+        write_binary_ints(w->out, row + i + 1, n - i - 1, dtype_size);
+    } else if (format == FORMAT_CONDENSED) {
+        for (int j = i + 1; j < n; j++) {
+            writer_put_int(w, row[j]);
+            writer_put_char(w, '\n');
+        }
+    } else {
+        for (int j = 0; j < n; j++) {
+            writer_put_int(w, row[j]);
+            writer_put_char(w, ' ');
         }
+        writer_put_char(w, '\n');
+    }
+}
 
-        #pragma omp parallel for schedule(dynamic)
-        for (int j = 1; j < num_structures; j++) {
-            int ted = tree_edit_dist(ti_array[0], ti_array[j]);
-            distances[j - 1] = ted;
+void write_triangle(TextWriter* w, Triangle* tri, int format, uint64_t input_hash) {
+    int n = tri->n;
+    if (format == FORMAT_BINARY) {
+        writer_flush(w);
+        write_binary_header(w->out, n, tri->dtype_size, input_hash);
+        write_binary_values(w->out, tri->data, triangle_size(n), tri->dtype_size);
+    } else if (format == FORMAT_CONDENSED) {
+        size_t count = triangle_size(n);
+        for (size_t k = 0; k < count; k++) {
+            writer_put_int(w, get_distance_at(tri, k));
+            writer_put_char(w, '\n');
+        }
+    } else {
+        for (int i = 0; i < n; i++) {
+            for (int j = 0; j < n; j++) {
+                writer_put_int(w, get_distance(tri, i, j));
+                writer_put_char(w, ' ');
+            }
+            writer_put_char(w, '\n');
         }
+    }
+    writer_flush(w);
+}
 
-        // Output distances one below the other
-        for (int j = 0; j < num_structures - 1; j++) {
-            printf("%d\n", distances[j]);
+// Fills every cell that involves a duplicate from the cell of the two
+// representatives, which must already be computed
+void fill_duplicate_cells(Triangle* tri, const int* rep) {
+    int n = tri->n;
+    #pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < n; i++) {
+        for (int j = i + 1; j < n; j++) {
+            if (rep[i] == i && rep[j] == j) continue;
+            set_distance(tri, i, j, rep[i] == rep[j] ? 0 : get_distance(tri, rep[i], rep[j]));
         }
+    }
+}
 
-        free(distances);
-    } else if (row_wise) {
-        // Row-wise computation and output
-        _Atomic int completed_rows = 0;
-        int last_percentage = -1;
+static int compare_neighbor_index(const void* a, const void* b) {
+    const Neighbor* na = a;
+    const Neighbor* nb = b;
+    return (na->index > nb->index) - (na->index < nb->index);
+}
 
-        #pragma omp parallel for schedule(dynamic)
-        for (int i = 0; i < num_structures; i++) {
-            int* row = malloc(num_structures * sizeof(int));
-            if (!row) {
-                fprintf(stderr, "Memory allocation failed for row\n");
+void write_edge(TextWriter* w, int i, int j, int d) {
+    writer_put_int(w, i);
+    writer_put_char(w, ' ');
+    writer_put_int(w, j);
+    writer_put_char(w, ' ');
+    writer_put_int(w, d);
+    writer_put_char(w, '\n');
+}
+
+// (distance, index) order used for nearest-neighbour ranking
+static int neighbor_less(const Neighbor* a, const Neighbor* b) {
+    if (a->distance != b->distance) return a->distance < b->distance;
+    return a->index < b->index;
+}
+
+static int compare_neighbor_rank(const void* a, const void* b) {
+    return neighbor_less(b, a) - neighbor_less(a, b);
+}
+
+// Bounded max-heap keeping the `capacity` best neighbours seen so far;
+// the root is the current worst of them
+void heap_offer(Neighbor* heap, int* size, int capacity, int index, int distance) {
+    Neighbor item = {index, distance};
+    if (*size < capacity) {
+        int pos = (*size)++;
+        while (pos > 0 && neighbor_less(&heap[(pos - 1) / 2], &item)) {
+            heap[pos] = heap[(pos - 1) / 2];
+            pos = (pos - 1) / 2;
+        }
+        heap[pos] = item;
+        return;
+    }
+    if (!neighbor_less(&item, &heap[0])) return;
+    int pos = 0;
+    for (;;) {
+        int child = 2 * pos + 1;
+        if (child >= *size) break;
+        if (child + 1 < *size && neighbor_less(&heap[child], &heap[child + 1])) child++;
+        if (!neighbor_less(&item, &heap[child])) break;
+        heap[pos] = heap[child];
+        pos = child;
+    }
+    heap[pos] = item;
+}
+
+static const TreeInfo* const* sort_trees;
+
+static int compare_by_label_counts(const void* a, const void* b) {
+    const TreeInfo* ta = sort_trees[*(const int*)a];
+    const TreeInfo* tb = sort_trees[*(const int*)b];
+    if (ta->num_pairs != tb->num_pairs) return ta->num_pairs - tb->num_pairs;
+    if (ta->num_unpaired != tb->num_unpaired) return ta->num_unpaired - tb->num_unpaired;
+    return *(const int*)a - *(const int*)b;
+}
+
+// Groups representatives by (pairs, unpaired) counts, the only inputs of
+// ted_lower_bound, so candidates can be visited in lower-bound order by
+// sorting buckets instead of individual structures. Returns the bucket count
+int group_by_label_counts(TreeInfo** ti_array, const int* rep, int n, int* order, LabelBucket** buckets_out) {
+    int count = 0;
+    for (int i = 0; i < n; i++) {
+        if (rep[i] == i) order[count++] = i;
+    }
+    sort_trees = (const TreeInfo* const*)ti_array;
+    qsort(order, count, sizeof(int), compare_by_label_counts);
+    LabelBucket* buckets = malloc((count > 0 ? count : 1) * sizeof(LabelBucket));
+    if (!buckets) {
+        fprintf(stderr, "Memory allocation failed for label buckets\n");
+        exit(1);
+    }
+    int num_buckets = 0;
+    for (int k = 0; k < count; k++) {
+        TreeInfo* ti = ti_array[order[k]];
+        if (num_buckets == 0 || buckets[num_buckets - 1].num_pairs != ti->num_pairs ||
+            buckets[num_buckets - 1].num_unpaired != ti->num_unpaired) {
+            buckets[num_buckets].num_pairs = ti->num_pairs;
+            buckets[num_buckets].num_unpaired = ti->num_unpaired;
+            buckets[num_buckets].start = k;
+            num_buckets++;
+        }
+        buckets[num_buckets - 1].end = k + 1;
+    }
+    *buckets_out = buckets;
+    return num_buckets;
+}
+
+Checkpoint* create_checkpoint(const char* output_path, int n, int dtype_size, uint64_t input_hash, int num_units, double interval) {
+    Checkpoint* ck = malloc(sizeof(Checkpoint));
+    if (!ck) {
+        fprintf(stderr, "Memory allocation failed for checkpoint\n");
+        exit(1);
+    }
+    ck->path = malloc(strlen(output_path) + sizeof(CHECKPOINT_SUFFIX));
+    ck->done = calloc(num_units > 0 ? num_units : 1, 1);
+    if (!ck->path || !ck->done) {
+        fprintf(stderr, "Memory allocation failed for checkpoint\n");
+        exit(1);
+    }
+    sprintf(ck->path, "%s%s", output_path, CHECKPOINT_SUFFIX);
+    ck->num_units = num_units;
+    ck->n = n;
+    ck->dtype_size = dtype_size;
+    ck->input_hash = input_hash;
+    ck->interval = interval;
+    ck->last_write = omp_get_wtime();
+    return ck;
+}
+
+// Marks the units recorded in an existing checkpoint as done; returns how many
+int load_checkpoint(Checkpoint* ck) {
+    FILE* in = fopen(ck->path, "rb");
+    if (!in) {
+        fprintf(stderr, "No checkpoint found at %s\n", ck->path);
+        exit(1);
+    }
+    uint8_t header[CHECKPOINT_HEADER_SIZE];
+    if (fread(header, 1, CHECKPOINT_HEADER_SIZE, in) != CHECKPOINT_HEADER_SIZE ||
+        memcmp(header, CHECKPOINT_MAGIC, 8) != 0) {
+        fprintf(stderr, "Invalid checkpoint file %s\n", ck->path);
+        exit(1);
+    }
+    if (get_le(header + 8, 4) != CHECKPOINT_VERSION || (int)get_le(header + 12, 4) != ck->dtype_size || (int)get_le(header + 16, 8) != ck->n ||
+        get_le(header + 24, 8) != ck->input_hash || (int)get_le(header + 32, 8) != ck->num_units) {
+        fprintf(stderr, "Checkpoint %s does not match this input and configuration\n", ck->path);
+        exit(1);
+    }
+    size_t bitmap_size = ((size_t)ck->num_units + 7) / 8;
+    uint8_t* bitmap = malloc(bitmap_size > 0 ? bitmap_size : 1);
+    if (!bitmap) {
+        fprintf(stderr, "Memory allocation failed for checkpoint\n");
+        exit(1);
+    }
+    if (fread(bitmap, 1, bitmap_size, in) != bitmap_size) {
+        fprintf(stderr, "Truncated checkpoint file %s\n", ck->path);
+        exit(1);
+    }
+    fclose(in);
+    int completed = 0;
+    for (int u = 0; u < ck->num_units; u++) {
+        ck->done[u] = (bitmap[u / 8] >> (u % 8)) & 1;
+        completed += ck->done[u];
+    }
+    free(bitmap);
+    return completed;
+}
+
+// Flushes the mapped output and then records every unit that was complete
+// before the flush. The file is replaced atomically, so a crash at any
+// point leaves either the old or the new checkpoint behind
+void save_checkpoint(Checkpoint* ck, Triangle* tri) {
+    size_t bitmap_size = ((size_t)ck->num_units + 7) / 8;
+    uint8_t* bitmap = calloc(bitmap_size > 0 ? bitmap_size : 1, 1);
+    char* tmp_path = malloc(strlen(ck->path) + 5);
+    if (!bitmap || !tmp_path) {
+        fprintf(stderr, "Memory allocation failed for checkpoint\n");
+        exit(1);
+    }
+    for (int u = 0; u < ck->num_units; u++) {
+        if (__atomic_load_n(&ck->done[u], __ATOMIC_ACQUIRE)) {
+            bitmap[u / 8] |= (uint8_t)(1 << (u % 8));
+        }
+    }
+    if (msync(tri->map, tri->map_size, MS_SYNC) != 0) {
+        fprintf(stderr, "Failed to flush output file\n");
+        exit(1);
+    }
+
+    uint8_t header[CHECKPOINT_HEADER_SIZE] = {0};
+    memcpy(header, CHECKPOINT_MAGIC, 8);
+    put_le(header + 8, CHECKPOINT_VERSION, 4);
+    put_le(header + 12, ck->dtype_size, 4);
+    put_le(header + 16, (uint64_t)ck->n, 8);
+    put_le(header + 24, ck->input_hash, 8);
+    put_le(header + 32, (uint64_t)ck->num_units, 8);
+    sprintf(tmp_path, "%s.tmp", ck->path);
+    FILE* out = fopen(tmp_path, "wb");
+    if (!out || fwrite(header, 1, CHECKPOINT_HEADER_SIZE, out) != CHECKPOINT_HEADER_SIZE ||
+        fwrite(bitmap, 1, bitmap_size, out) != bitmap_size || fflush(out) != 0 ||
+        fsync(fileno(out)) != 0 || fclose(out) != 0 || rename(tmp_path, ck->path) != 0) {
+        fprintf(stderr, "Failed to write checkpoint %s\n", ck->path);
+        exit(1);
+    }
+    free(tmp_path);
+    free(bitmap);
+    ck->last_write = omp_get_wtime();
+}
+
+// Called by workers after finishing a unit; writes a checkpoint when the
+// interval has elapsed, with at most one thread doing so at a time
+void mark_unit_done(Checkpoint* ck, Triangle* tri, int unit) {
+    __atomic_store_n(&ck->done[unit], 1, __ATOMIC_RELEASE);
+    if (ck->interval <= 0 || omp_get_wtime() - ck->last_write < ck->interval) return;
+    #pragma omp critical(checkpoint)
+    {
+        if (omp_get_wtime() - ck->last_write >= ck->interval) {
+            save_checkpoint(ck, tri);
+        }
+    }
+}
+
+void free_checkpoint(Checkpoint* ck) {
+    if (!ck) return;
+    free(ck->path);
+    free(ck->done);
+    free(ck);
+}
+
+// Estimated work of one tree: the summed keyroot subtree sizes of its
+// cheaper orientation, so a pair costs roughly the product of two of these
+int64_t tree_cost(const TreeInfo* ti) {
+    if (ti->mirror && ti->mirror->keyroot_cost < ti->keyroot_cost) return ti->mirror->keyroot_cost;
+    return ti->keyroot_cost;
+}
+
+// Splits the pairs of representatives into tiles of tile_size x tile_size
+// (upper triangle only) in canonical order, which is also the checkpoint
+// unit order. Each tile's cost is the product of its two blocks' tree costs
+Tile* plan_tiles(TreeInfo** ti_array, const int* reps, int num_reps, int tile_size, int* num_tiles) {
+    int num_blocks = (num_reps + tile_size - 1) / tile_size;
+    int64_t* block_cost = calloc(num_blocks > 0 ? num_blocks : 1, sizeof(int64_t));
+    Tile* tiles = malloc(((size_t)num_blocks * (num_blocks + 1) / 2 + 1) * sizeof(Tile));
+    if (!block_cost || !tiles) {
+        fprintf(stderr, "Memory allocation failed for tile schedule\n");
+        exit(1);
+    }
+    for (int k = 0; k < num_reps; k++) {
+        block_cost[k / tile_size] += tree_cost(ti_array[reps[k]]);
+    }
+    int count = 0;
+    for (int a = 0; a < num_blocks; a++) {
+        int rows = min(tile_size, num_reps - a * tile_size);
+        for (int b = a; b < num_blocks; b++) {
+            int cols = min(tile_size, num_reps - b * tile_size);
+            Tile* tile = &tiles[count];
+            tile->id = count++;
+            tile->row_block = a;
+            tile->col_block = b;
+            if (a == b) {
+                tile->pairs = (int64_t)rows * (rows - 1) / 2;
+                tile->cost = block_cost[a] * block_cost[a] / 2;
+            } else {
+                tile->pairs = (int64_t)rows * cols;
+                tile->cost = block_cost[a] * block_cost[b];
+            }
+        }
+    }
+    free(block_cost);
+    *num_tiles = count;
+    return tiles;
+}
+
+// Most expensive first, so the long tiles start early and short ones fill
+// the gaps at the end
+static int compare_tile_cost(const void* a, const void* b) {
+    const Tile* ta = a;
+    const Tile* tb = b;
+    if (ta->cost != tb->cost) return ta->cost < tb->cost ? 1 : -1;
+    return ta->id - tb->id;
+}
+
+// Longest-processing-time assignment of tiles to shards: in decreasing
+// cost order, each tile goes to the shard with the least work so far.
+// Every process computes the same plan from the same input, so shards need
+// no coordination. Returns the owning shard per tile id
+int* assign_shards(const Tile* tiles, int num_tiles, int num_shards) {
+    Tile* sorted = malloc((num_tiles > 0 ? num_tiles : 1) * sizeof(Tile));
+    int* owner = malloc((num_tiles > 0 ? num_tiles : 1) * sizeof(int));
+    int64_t* load = calloc(num_shards, sizeof(int64_t));
+    if (!sorted || !owner || !load) {
+        fprintf(stderr, "Memory allocation failed for shard plan\n");
+        exit(1);
+    }
+    memcpy(sorted, tiles, num_tiles * sizeof(Tile));
+    qsort(sorted, num_tiles, sizeof(Tile), compare_tile_cost);
+    for (int t = 0; t < num_tiles; t++) {
+        int best = 0;
+        for (int s = 1; s < num_shards; s++) {
+            if (load[s] < load[best]) best = s;
+        }
+        owner[sorted[t].id] = best;
+        // Tiles without pairs still count, so that they are spread evenly
+        load[best] += sorted[t].cost + 1;
+    }
+    free(sorted);
+    free(load);
+    return owner;
+}
+
+// Shard file: header, duplicate map, then one record per computed tile
+// (id, row block, column block, pair count) followed by its distances in
+// row-major order within the tile
+void write_shard_header(FILE* out, int n, int dtype_size, uint64_t input_hash, int shard, int num_shards,
+                        int tile_size, int num_unique, int num_tiles, int shard_tiles, const int* rep) {
+    uint8_t header[SHARD_HEADER_SIZE] = {0};
+    memcpy(header, SHARD_MAGIC, 8);
+    put_le(header + 8, SHARD_VERSION, 4);
+    put_le(header + 12, dtype_size, 4);
+    put_le(header + 16, (uint64_t)n, 8);
+    put_le(header + 24, input_hash, 8);
+    put_le(header + 32, shard, 4);
+    put_le(header + 36, num_shards, 4);
+    put_le(header + 40, tile_size, 4);
+    put_le(header + 44, num_unique, 4);
+    put_le(header + 48, (uint64_t)num_tiles, 8);
+    put_le(header + 56, (uint64_t)shard_tiles, 8);
+    if (fwrite(header, 1, SHARD_HEADER_SIZE, out) != SHARD_HEADER_SIZE) {
+        fprintf(stderr, "Failed to write output\n");
+        exit(1);
+    }
+    write_binary_ints(out, rep, n, 4);
+}
+
+void write_shard_tile(FILE* out, const Tile* tile, const int* values, int dtype_size) {
+    uint8_t record[SHARD_RECORD_SIZE];
+    put_le(record, tile->id, 4);
+    put_le(record + 4, tile->row_block, 4);
+    put_le(record + 8, tile->col_block, 4);
+    put_le(record + 12, (uint64_t)tile->pairs, 4);
+    if (fwrite(record, 1, SHARD_RECORD_SIZE, out) != SHARD_RECORD_SIZE) {
+        fprintf(stderr, "Failed to write output\n");
+        exit(1);
+    }
+    write_binary_ints(out, values, tile->pairs, dtype_size);
+}
+
+// "merge" subcommand: assembles the shard files of one --shard run into the
+// full matrix, condensed or binary output
+int merge_shards(int argc, char* argv[]) {
+    int opt;
+    int format = FORMAT_MATRIX;
+    int dtype_size = 4;
+    const char* output_path = NULL;
+    struct option long_options[] = {
+        {"help", no_argument, 0, 'h'},
+        {"format", required_argument, 0, 'F'},
+        {"dtype", required_argument, 0, 'D'},
+        {"output", required_argument, 0, 'o'},
+        {0, 0, 0, 0}
+    };
+    while ((opt = getopt_long(argc, argv, "hF:D:o:", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'h':
+                printf("Usage: RNAtedistance merge [options] SHARD_FILE...\n");
+                printf("Options:\n");
+                printf("  --format, -F       Output format: matrix, condensed or binary (default: matrix)\n");
+                printf("  --dtype, -D        Value type for binary output: uint16 or uint32 (default: uint32)\n");
+                printf("  --output, -o       Write output to a file instead of standard output\n");
+                return 0;
+            case 'F':
+                if (strcmp(optarg, "matrix") == 0) {
+                    format = FORMAT_MATRIX;
+                } else if (strcmp(optarg, "condensed") == 0) {
+                    format = FORMAT_CONDENSED;
+                } else if (strcmp(optarg, "binary") == 0) {
+                    format = FORMAT_BINARY;
+                } else {
+                    fprintf(stderr, "Invalid output format: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'D':
+                if (strcmp(optarg, "uint16") == 0) {
+                    dtype_size = 2;
+                } else if (strcmp(optarg, "uint32") == 0) {
+                    dtype_size = 4;
+                } else {
+                    fprintf(stderr, "Invalid binary value type: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'o':
+                output_path = optarg;
+                break;
+            default:
+                fprintf(stderr, "Invalid option. Use merge --help for usage information.\n");
+                return 1;
+        }
+    }
+    int num_files = argc - optind;
+    if (num_files <= 0) {
+        fprintf(stderr, "No shard files given\n");
+        return 1;
+    }
+
+    Triangle* tri = NULL;
+    int* rep = NULL;
+    int* reps = NULL;
+    unsigned char* seen_shard = NULL;
+    unsigned char* seen_tile = NULL;
+    uint8_t* buffer = NULL;
+    int n = 0, num_shards = 0, tile_size = 0, num_unique = 0, num_tiles = 0;
+    uint64_t input_hash = 0;
+    int mapped_output = output_path && format == FORMAT_BINARY;
+
+    for (int f = 0; f < num_files; f++) {
+        const char* path = argv[optind + f];
+        FILE* in = fopen(path, "rb");
+        if (!in) {
+            fprintf(stderr, "Failed to open shard file %s\n", path);
+            return 1;
+        }
+        uint8_t header[SHARD_HEADER_SIZE];
+        if (fread(header, 1, SHARD_HEADER_SIZE, in) != SHARD_HEADER_SIZE || memcmp(header, SHARD_MAGIC, 8) != 0 ||
+            get_le(header + 8, 4) != SHARD_VERSION) {
+            fprintf(stderr, "Invalid shard file %s\n", path);
+            return 1;
+        }
+        int shard_dtype = (int)get_le(header + 12, 4);
+        int shard = (int)get_le(header + 32, 4);
+        int shard_tiles = (int)get_le(header + 56, 8);
+        if (f == 0) {
+            n = (int)get_le(header + 16, 8);
+            input_hash = get_le(header + 24, 8);
+            num_shards = (int)get_le(header + 36, 4);
+            tile_size = (int)get_le(header + 40, 4);
+            num_unique = (int)get_le(header + 44, 4);
+            num_tiles = (int)get_le(header + 48, 8);
+            rep = malloc(n * sizeof(int));
+            reps = malloc(num_unique * sizeof(int));
+            seen_shard = calloc(num_shards > 0 ? num_shards : 1, 1);
+            seen_tile = calloc(num_tiles > 0 ? num_tiles : 1, 1);
+            buffer = malloc((size_t)tile_size * tile_size * 4);
+            if (!rep || !reps || !seen_shard || !seen_tile || !buffer) {
+                fprintf(stderr, "Memory allocation failed for merge\n");
+                return 1;
+            }
+            // The duplicate map has n entries, more than a tile for large inputs
+            uint8_t* rep_bytes = malloc((size_t)(n > 0 ? n : 1) * 4);
+            if (!rep_bytes) {
+                fprintf(stderr, "Memory allocation failed for merge\n");
+                return 1;
+            }
+            if (fread(rep_bytes, 4, n, in) != (size_t)n) {
+                fprintf(stderr, "Truncated shard file %s\n", path);
+                return 1;
+            }
+            int count = 0;
+            for (int i = 0; i < n; i++) {
+                rep[i] = (int)get_le(rep_bytes + (size_t)i * 4, 4);
+                if (rep[i] == i && count < num_unique) reps[count++] = i;
+            }
+            free(rep_bytes);
+            if (count != num_unique) {
+                fprintf(stderr, "Invalid shard file %s\n", path);
+                return 1;
+            }
+            if (mapped_output) {
+                tri = create_mapped_triangle(output_path, n, dtype_size);
+            } else {
+                tri = create_triangle(n, format == FORMAT_BINARY ? dtype_size : 4);
+            }
+        } else {
+            if ((int)get_le(header + 16, 8) != n || get_le(header + 24, 8) != input_hash ||
+                (int)get_le(header + 36, 4) != num_shards || (int)get_le(header + 40, 4) != tile_size ||
+                (int)get_le(header + 44, 4) != num_unique || (int)get_le(header + 48, 8) != num_tiles) {
+                fprintf(stderr, "Shard file %s belongs to a different run\n", path);
+                return 1;
+            }
+            if (fseeko(in, (off_t)n * 4, SEEK_CUR) != 0) {
+                fprintf(stderr, "Truncated shard file %s\n", path);
+                return 1;
+            }
+        }
+        if (shard < 0 || shard >= num_shards || seen_shard[shard]) {
+            fprintf(stderr, "Shard file %s is a duplicate or out of range\n", path);
+            return 1;
+        }
+        seen_shard[shard] = 1;
+
+        for (int t = 0; t < shard_tiles; t++) {
+            uint8_t record[SHARD_RECORD_SIZE];
+            if (fread(record, 1, SHARD_RECORD_SIZE, in) != SHARD_RECORD_SIZE) {
+                fprintf(stderr, "Truncated shard file %s\n", path);
+                return 1;
+            }
+            int id = (int)get_le(record, 4);
+            int row_block = (int)get_le(record + 4, 4);
+            int col_block = (int)get_le(record + 8, 4);
+            int64_t pairs = (int64_t)get_le(record + 12, 4);
+            int a0 = row_block * tile_size;
+            int a1 = min(a0 + tile_size, num_unique);
+            int b0 = col_block * tile_size;
+            int b1 = min(b0 + tile_size, num_unique);
+            int64_t expected = row_block == col_block ? (int64_t)(a1 - a0) * (a1 - a0 - 1) / 2 : (int64_t)(a1 - a0) * (b1 - b0);
+            if (id < 0 || id >= num_tiles || seen_tile[id] || row_block > col_block || b0 >= num_unique || pairs != expected) {
+                fprintf(stderr, "Invalid tile record in shard file %s\n", path);
+                return 1;
+            }
+            seen_tile[id] = 1;
+            if (fread(buffer, shard_dtype, pairs, in) != (size_t)pairs) {
+                fprintf(stderr, "Truncated shard file %s\n", path);
+                return 1;
+            }
+            int64_t k = 0;
+            for (int a = a0; a < a1; a++) {
+                for (int b = b0 > a + 1 ? b0 : a + 1; b < b1; b++) {
+                    set_distance(tri, reps[a], reps[b], (int)get_le(buffer + k * shard_dtype, shard_dtype));
+                    k++;
+                }
+            }
+        }
+        fclose(in);
+    }
+    for (int s = 0; s < num_shards; s++) {
+        if (!seen_shard[s]) {
+            fprintf(stderr, "Shard %d of %d is missing\n", s, num_shards);
+            return 1;
+        }
+    }
+    for (int t = 0; t < num_tiles; t++) {
+        if (!seen_tile[t]) {
+            fprintf(stderr, "Tile %d is missing from the shard files\n", t);
+            return 1;
+        }
+    }
+
+    if (num_unique < n) {
+        fill_duplicate_cells(tri, rep);
+    }
+    if (mapped_output) {
+        fill_binary_header(tri->map, n, dtype_size, input_hash);
+    } else {
+        TextWriter* writer = malloc(sizeof(TextWriter));
+        if (!writer) {
+            fprintf(stderr, "Memory allocation failed for output buffer\n");
+            return 1;
+        }
+        writer->out = stdout;
+        writer->len = 0;
+        if (output_path) {
+            writer->out = fopen(output_path, "wb");
+            if (!writer->out) {
+                fprintf(stderr, "Failed to open output file %s\n", output_path);
+                return 1;
+            }
+        }
+        write_triangle(writer, tri, format, input_hash);
+        if (writer->out != stdout && fclose(writer->out) != 0) {
+            fprintf(stderr, "Failed to write output file %s\n", output_path);
+            return 1;
+        }
+        free(writer);
+    }
+    free_triangle(tri);
+    free(rep);
+    free(reps);
+    free(seen_shard);
+    free(seen_tile);
+    free(buffer);
+    return 0;
+}
+
+// Writes the parsed input set as a binary index: header, duplicate map,
+// one record per tree and orientation, then the node arrays of all trees
+// back to back. Every tree is stored in both orientations so the index
+// serves every --algorithm. Arrays are raw little-endian data that
+// load_structure_index maps without parsing
+void write_structure_index(const char* path, TreeInfo** ti_array, const int* rep, int n, uint64_t input_hash) {
+    if (!host_is_little_endian()) {
+        fprintf(stderr, "Structure indices are only supported on little-endian hosts\n");
+        exit(1);
+    }
+    int num_unique = 0;
+    uint64_t total_nodes = 0;
+    uint64_t total_keyroots = 0;
+    for (int i = 0; i < n; i++) {
+        if (rep[i] != i) continue;
+        TreeInfo* ti = ti_array[i];
+        num_unique++;
+        total_nodes += ti->postorder_size + ti->mirror->postorder_size;
+        total_keyroots += ti->num_keyroots + ti->mirror->num_keyroots;
+    }
+    FILE* out = fopen(path, "wb");
+    if (!out) {
+        fprintf(stderr, "Failed to open index file %s\n", path);
+        exit(1);
+    }
+    uint8_t header[INDEX_HEADER_SIZE] = {0};
+    memcpy(header, INDEX_MAGIC, 8);
+    put_le(header + 8, INDEX_VERSION, 4);
+    put_le(header + 16, (uint64_t)n, 8);
+    put_le(header + 24, (uint64_t)num_unique, 8);
+    put_le(header + 32, input_hash, 8);
+    put_le(header + 40, total_nodes, 8);
+    put_le(header + 48, total_keyroots, 8);
+    int ok = fwrite(header, 1, INDEX_HEADER_SIZE, out) == INDEX_HEADER_SIZE;
+
+    // Duplicate map, padded to 8 bytes
+    int32_t pad = 0;
+    for (int i = 0; i < n && ok; i++) {
+        int32_t r = rep[i];
+        ok = fwrite(&r, sizeof(int32_t), 1, out) == 1;
+    }
+    if (n % 2 == 1 && ok) ok = fwrite(&pad, sizeof(int32_t), 1, out) == 1;
+
+    // Records: left tree at 2u, mirrored tree at 2u + 1
+    uint64_t node_offset = 0;
+    uint64_t keyroot_offset = 0;
+    for (int i = 0; i < n && ok; i++) {
+        if (rep[i] != i) continue;
+        for (int side = 0; side < 2 && ok; side++) {
+            TreeInfo* ti = side ? ti_array[i]->mirror : ti_array[i];
+            uint8_t record[INDEX_RECORD_SIZE];
+            put_le(record, node_offset, 8);
+            put_le(record + 8, keyroot_offset, 8);
+            put_le(record + 16, (uint64_t)ti->keyroot_cost, 8);
+            put_le(record + 24, (uint64_t)ti->postorder_size, 4);
+            put_le(record + 28, (uint64_t)ti->num_keyroots, 4);
+            put_le(record + 32, (uint64_t)ti->num_pairs, 4);
+            put_le(record + 36, (uint64_t)ti->num_unpaired, 4);
+            ok = fwrite(record, 1, INDEX_RECORD_SIZE, out) == INDEX_RECORD_SIZE;
+            node_offset += ti->postorder_size;
+            keyroot_offset += ti->num_keyroots;
+        }
+    }
+    // Sections in decreasing alignment: hashes, leftmost, keyroots, labels
+    for (int section = 0; section < 4 && ok; section++) {
+        for (int i = 0; i < n && ok; i++) {
+            if (rep[i] != i) continue;
+            for (int side = 0; side < 2 && ok; side++) {
+                TreeInfo* ti = side ? ti_array[i]->mirror : ti_array[i];
+                if (section == 0) {
+                    ok = fwrite(ti->keyroot_hash, sizeof(uint64_t), ti->num_keyroots, out) == (size_t)ti->num_keyroots;
+                } else if (section == 1) {
+                    ok = fwrite(ti->leftmost, sizeof(int32_t), ti->postorder_size, out) == (size_t)ti->postorder_size;
+                } else if (section == 2) {
+                    ok = fwrite(ti->keyroots, sizeof(int32_t), ti->num_keyroots, out) == (size_t)ti->num_keyroots;
+                } else {
+                    ok = fwrite(ti->labels, 1, ti->postorder_size, out) == (size_t)ti->postorder_size;
+                }
+            }
+        }
+    }
+    if (!ok || fclose(out) != 0) {
+        fprintf(stderr, "Failed to write index file %s\n", path);
+        exit(1);
+    }
+    fprintf(stderr, "Wrote index of %d structures (%d unique) to %s\n", n, num_unique, path);
+}
+
+// Maps an index read-only. TreeInfo headers are filled in to point into the
+// mapping; nothing is parsed, and concurrent jobs share the page cache.
+// With --algorithm right the mirrored trees become the primary ones
+StructureIndex* load_structure_index(const char* path, int algorithm) {
+    if (!host_is_little_endian()) {
+        fprintf(stderr, "Structure indices are only supported on little-endian hosts\n");
+        exit(1);
+    }
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open index file %s\n", path);
+        exit(1);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < INDEX_HEADER_SIZE) {
+        fprintf(stderr, "Invalid index file %s\n", path);
+        exit(1);
+    }
+    size_t size = st.st_size;
+    uint8_t* map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Failed to map index file %s\n", path);
+        exit(1);
+    }
+    if (memcmp(map, INDEX_MAGIC, 8) != 0 || get_le(map + 8, 4) != INDEX_VERSION) {
+        fprintf(stderr, "Invalid index file %s\n", path);
+        exit(1);
+    }
+    uint64_t stored_n = get_le(map + 16, 8);
+    uint64_t stored_unique = get_le(map + 24, 8);
+    uint64_t total_nodes = get_le(map + 40, 8);
+    uint64_t total_keyroots = get_le(map + 48, 8);
+    // Counts are bounded before any offset is computed from them
+    if (stored_n == 0 || stored_n > INT_MAX || stored_unique == 0 || stored_unique > stored_n ||
+        total_nodes > size || total_keyroots > size) {
+        fprintf(stderr, "Index file %s is truncated or corrupt\n", path);
+        exit(1);
+    }
+    int n = (int)stored_n;
+    int num_unique = (int)stored_unique;
+    size_t rep_offset = INDEX_HEADER_SIZE;
+    size_t record_offset = rep_offset + ((size_t)n + 1) / 2 * 8;
+    size_t hash_offset = record_offset + (size_t)num_unique * 2 * INDEX_RECORD_SIZE;
+    size_t leftmost_offset = hash_offset + total_keyroots * sizeof(uint64_t);
+    size_t keyroots_offset = leftmost_offset + total_nodes * sizeof(int32_t);
+    size_t labels_offset = keyroots_offset + total_keyroots * sizeof(int32_t);
+    if (labels_offset + total_nodes != size) {
+        fprintf(stderr, "Index file %s is truncated or corrupt\n", path);
+        exit(1);
+    }
+
+    StructureIndex* index = malloc(sizeof(StructureIndex));
+    TreeInfo* trees = malloc(((size_t)num_unique * 2 + 1) * sizeof(TreeInfo));
+    int* rep = malloc(n * sizeof(int));
+    TreeInfo** ti_array = malloc(n * sizeof(TreeInfo*));
+    if (!index || !trees || !rep || !ti_array) {
+        fprintf(stderr, "Memory allocation failed for structure index\n");
+        exit(1);
+    }
+    memcpy(rep, map + rep_offset, n * sizeof(int));
+    uint64_t* hashes = (uint64_t*)(map + hash_offset);
+    int32_t* leftmost = (int32_t*)(map + leftmost_offset);
+    int32_t* keyroots = (int32_t*)(map + keyroots_offset);
+    uint8_t* labels = map + labels_offset;
+    int max_nodes = 0;
+    int u = 0;
+    for (int i = 0; i < n; i++) {
+        if (rep[i] < 0 || rep[i] > i || (rep[i] != i && rep[rep[i]] != rep[i]) || (rep[i] == i && u >= num_unique)) {
+            fprintf(stderr, "Index file %s is truncated or corrupt\n", path);
+            exit(1);
+        }
+        if (rep[i] != i) {
+            ti_array[i] = ti_array[rep[i]];
+            continue;
+        }
+        for (int side = 0; side < 2; side++) {
+            const uint8_t* record = map + record_offset + ((size_t)u * 2 + side) * INDEX_RECORD_SIZE;
+            TreeInfo* ti = &trees[(size_t)u * 2 + side];
+            uint64_t nodes_at = get_le(record, 8);
+            uint64_t keyroots_at = get_le(record + 8, 8);
+            ti->keyroot_cost = (int64_t)get_le(record + 16, 8);
+            ti->postorder_size = (int)get_le(record + 24, 4);
+            ti->num_keyroots = (int)get_le(record + 28, 4);
+            ti->num_pairs = (int)get_le(record + 32, 4);
+            ti->num_unpaired = (int)get_le(record + 36, 4);
+            if (ti->postorder_size < 1 || ti->num_keyroots < 1 || ti->num_keyroots > ti->postorder_size ||
+                nodes_at + ti->postorder_size > total_nodes || keyroots_at + ti->num_keyroots > total_keyroots) {
+                fprintf(stderr, "Index file %s is truncated or corrupt\n", path);
+                exit(1);
+            }
+            ti->labels = labels + nodes_at;
+            ti->leftmost = leftmost + nodes_at;
+            ti->keyroots = keyroots + keyroots_at;
+            ti->keyroot_hash = hashes + keyroots_at;
+            ti->mirror = NULL;
+            ti->mirrored = side;
+            // Node indices are used unchecked by the DP
+            int valid = 1;
+            for (int k = 0; k < ti->postorder_size; k++) {
+                valid &= ti->leftmost[k] >= 0 && ti->leftmost[k] <= k;
+            }
+            int64_t keyroot_cost = 0;
+            for (int x = 0; x < ti->num_keyroots && valid; x++) {
+                valid &= ti->keyroots[x] >= 0 && ti->keyroots[x] < ti->postorder_size;
+                if (valid) keyroot_cost += ti->keyroots[x] - ti->leftmost[ti->keyroots[x]] + 1;
+            }
+            if (!valid || keyroot_cost != ti->keyroot_cost) {
+                fprintf(stderr, "Index file %s is truncated or corrupt\n", path);
+                exit(1);
+            }
+        }
+        TreeInfo* left = &trees[(size_t)u * 2];
+        TreeInfo* right = &trees[(size_t)u * 2 + 1];
+        // Workspaces are sized by the primary tree, so both must match
+        if (left->postorder_size != right->postorder_size) {
+            fprintf(stderr, "Index file %s is truncated or corrupt\n", path);
+            exit(1);
+        }
+        if (algorithm == RNATED_ALGORITHM_RIGHT) {
+            ti_array[i] = right;
+        } else {
+            ti_array[i] = left;
+            if (algorithm == RNATED_ALGORITHM_AUTO) left->mirror = right;
+        }
+        if (ti_array[i]->postorder_size > max_nodes) max_nodes = ti_array[i]->postorder_size;
+        u++;
+    }
+    if (u != num_unique) {
+        fprintf(stderr, "Index file %s is truncated or corrupt\n", path);
+        exit(1);
+    }
+
+    index->map = map;
+    index->map_size = size;
+    index->trees = trees;
+    index->ti_array = ti_array;
+    index->rep = rep;
+    index->num_structures = n;
+    index->num_unique = num_unique;
+    index->max_nodes = max_nodes;
+    index->input_hash = get_le(map + 32, 8);
+    return index;
+}
+
+// Releases the mapping and the TreeInfo headers; rep and ti_array belong to
+// the caller
+void free_structure_index(StructureIndex* index) {
+    if (!index) return;
+    munmap(index->map, index->map_size);
+    free(index->trees);
+    free(index);
+}
+
+VPTree* create_vptree(int num_points) {
+    VPTree* tree = malloc(sizeof(VPTree));
+    int32_t* data = malloc((size_t)(num_points > 0 ? num_points : 1) * 6 * sizeof(int32_t));
+    if (!tree || !data) {
+        fprintf(stderr, "Memory allocation failed for vantage-point tree\n");
+        exit(1);
+    }
+    tree->num_points = num_points;
+    tree->point = data;
+    tree->split = data + num_points;
+    tree->inner_min = data + 2 * (size_t)num_points;
+    tree->inner_max = data + 3 * (size_t)num_points;
+    tree->outer_min = data + 4 * (size_t)num_points;
+    tree->outer_max = data + 5 * (size_t)num_points;
+    return tree;
+}
+
+void free_vptree(VPTree* tree) {
+    if (!tree) return;
+    free(tree->point);
+    free(tree);
+}
+
+// Builds the subtree over positions lo .. hi - 1: a pseudo-random vantage
+// point (the same for any thread count) measures its distance to all other
+// points, the closer half becomes the inner subtree and the rest the outer
+// one. Large subtrees and distance batches run as tasks
+static void build_vptree_node(VPTree* tree, int lo, int hi, TreeInfo** ti_array, Workspace** pool, Neighbor* scratch,
+                              Progress* progress, _Atomic int* placed) {
+    uint64_t h = (uint64_t)lo * 0x9E3779B97F4A7C15ULL ^ (uint64_t)hi;
+    h ^= h >> 31;
+    h *= 0xBF58476D1CE4E5B9ULL;
+    h ^= h >> 29;
+    int pick = lo + (int)(h % (uint64_t)(hi - lo));
+    int32_t vantage = tree->point[pick];
+    tree->point[pick] = tree->point[lo];
+    tree->point[lo] = vantage;
+
+    int count = hi - lo - 1;
+    #pragma omp taskloop grainsize(VPTREE_GRAIN) if(count > VPTREE_GRAIN)
+    for (int p = lo + 1; p < hi; p++) {
+        scratch[p].index = tree->point[p];
+        scratch[p].distance = tree_edit_dist(ti_array[vantage], ti_array[tree->point[p]], pool[omp_get_thread_num()]);
+    }
+    qsort(scratch + lo + 1, count, sizeof(Neighbor), compare_neighbor_rank);
+    for (int p = lo + 1; p < hi; p++) {
+        tree->point[p] = scratch[p].index;
+    }
+    int split = lo + 1 + (count + 1) / 2;
+    tree->split[lo] = split;
+    tree->inner_min[lo] = split > lo + 1 ? scratch[lo + 1].distance : 0;
+    tree->inner_max[lo] = split > lo + 1 ? scratch[split - 1].distance : 0;
+    tree->outer_min[lo] = hi > split ? scratch[split].distance : 0;
+    tree->outer_max[lo] = hi > split ? scratch[hi - 1].distance : 0;
+
+    int done = __atomic_add_fetch(placed, 1, __ATOMIC_SEQ_CST);
+    report_progress(progress, (int)((long long)done * 100 / tree->num_points));
+    if (split > lo + 1) {
+        #pragma omp task if(split - lo - 1 > VPTREE_TASK_SIZE)
+        build_vptree_node(tree, lo + 1, split, ti_array, pool, scratch, progress, placed);
+    }
+    if (hi > split) build_vptree_node(tree, split, hi, ti_array, pool, scratch, progress, placed);
+}
+
+// About n log2(n) distance computations over the representatives
+VPTree* build_vptree(TreeInfo** ti_array, const int* rep, int n, int num_unique, int max_nodes, int num_threads) {
+    VPTree* tree = create_vptree(num_unique);
+    Neighbor* scratch = malloc((size_t)(num_unique > 0 ? num_unique : 1) * sizeof(Neighbor));
+    if (!scratch) {
+        fprintf(stderr, "Memory allocation failed for vantage-point tree\n");
+        exit(1);
+    }
+    int num_points = 0;
+    for (int i = 0; i < n; i++) {
+        if (rep[i] == i) tree->point[num_points++] = i;
+    }
+    Workspace** pool = create_thread_pool(max_nodes, num_threads);
+    Progress progress = start_progress();
+    _Atomic int placed = 0;
+    if (num_points > 0) {
+        #pragma omp parallel num_threads(num_threads)
+        #pragma omp single
+        build_vptree_node(tree, 0, num_points, ti_array, pool, scratch, &progress, &placed);
+    }
+    fprintf(stderr, "\n");
+    free_workspace_pool(pool, num_threads);
+    free(scratch);
+    return tree;
+}
+
+void write_vptree(const char* path, const VPTree* tree, int n, uint64_t input_hash) {
+    if (!host_is_little_endian()) {
+        fprintf(stderr, "Vantage-point trees are only supported on little-endian hosts\n");
+        exit(1);
+    }
+    FILE* out = fopen(path, "wb");
+    if (!out) {
+        fprintf(stderr, "Failed to open vantage-point tree file %s\n", path);
+        exit(1);
+    }
+    uint8_t header[VPTREE_HEADER_SIZE] = {0};
+    memcpy(header, VPTREE_MAGIC, 8);
+    put_le(header + 8, VPTREE_VERSION, 4);
+    put_le(header + 16, (uint64_t)n, 8);
+    put_le(header + 24, (uint64_t)tree->num_points, 8);
+    put_le(header + 32, input_hash, 8);
+    size_t count = (size_t)tree->num_points * 6;
+    if (fwrite(header, 1, VPTREE_HEADER_SIZE, out) != VPTREE_HEADER_SIZE ||
+        fwrite(tree->point, sizeof(int32_t), count, out) != count || fclose(out) != 0) {
+        fprintf(stderr, "Failed to write vantage-point tree file %s\n", path);
+        exit(1);
+    }
+}
+
+// Loads a tree and checks that it was built from this reference set
+VPTree* load_vptree(const char* path, const int* rep, int n, uint64_t input_hash) {
+    if (!host_is_little_endian()) {
+        fprintf(stderr, "Vantage-point trees are only supported on little-endian hosts\n");
+        exit(1);
+    }
+    FILE* in = fopen(path, "rb");
+    if (!in) {
+        fprintf(stderr, "Failed to open vantage-point tree file %s\n", path);
+        exit(1);
+    }
+    uint8_t header[VPTREE_HEADER_SIZE];
+    if (fread(header, 1, VPTREE_HEADER_SIZE, in) != VPTREE_HEADER_SIZE || memcmp(header, VPTREE_MAGIC, 8) != 0 ||
+        get_le(header + 8, 4) != VPTREE_VERSION) {
+        fprintf(stderr, "Invalid vantage-point tree file %s\n", path);
+        exit(1);
+    }
+    int num_unique = 0;
+    for (int i = 0; i < n; i++) {
+        if (rep[i] == i) num_unique++;
+    }
+    if (get_le(header + 16, 8) != (uint64_t)n || get_le(header + 24, 8) != (uint64_t)num_unique ||
+        get_le(header + 32, 8) != input_hash) {
+        fprintf(stderr, "Vantage-point tree %s was not built from these reference structures\n", path);
+        exit(1);
+    }
+    VPTree* tree = create_vptree(num_unique);
+    size_t count = (size_t)num_unique * 6;
+    if (fread(tree->point, sizeof(int32_t), count, in) != count) {
+        fprintf(stderr, "Truncated vantage-point tree file %s\n", path);
+        exit(1);
+    }
+    fclose(in);
+    for (int p = 0; p < num_unique; p++) {
+        int v = tree->point[p];
+        if (v < 0 || v >= n || rep[v] != v || tree->split[p] <= p || tree->split[p] > num_unique) {
+            fprintf(stderr, "Invalid vantage-point tree file %s\n", path);
+            exit(1);
+        }
+    }
+    return tree;
+}
+
+// Largest distance that can still enter the result
+static int vptree_limit(const VPSearch* search) {
+    if (search->radius >= 0) return search->radius;
+    return search->count == search->knn ? search->found[0].distance : NO_BOUND;
+}
+
+// Lower bound on the distance from the query to every member of a child
+// whose distances to the vantage point lie in [low, high], given the
+// query's distance d to the vantage point (triangle inequality)
+static int vptree_child_bound(int d, int low, int high) {
+    int bound = low - d > d - high ? low - d : d - high;
+    return bound > 0 ? bound : 0;
+}
+
+static void vptree_offer(VPSearch* search, int v, int d) {
+    for (int m = search->member_start[v]; m < search->member_start[v + 1]; m++) {
+        if (search->radius < 0) {
+            heap_offer(search->found, &search->count, search->knn, search->members[m], d);
+            continue;
+        }
+        if (search->count == search->capacity) {
+            search->capacity *= 2;
+            search->found = realloc(search->found, search->capacity * sizeof(Neighbor));
+            if (!search->found) {
+                fprintf(stderr, "Memory allocation failed for search results\n");
+                exit(1);
+            }
+        }
+        search->found[search->count].index = search->members[m];
+        search->found[search->count++].distance = d;
+    }
+}
+
+// Searches the subtree at positions p .. end - 1. The distance to the
+// vantage point is capped at the current limit plus the largest distance
+// in the subtree: beyond that neither the vantage point nor any child can
+// be within the limit, so the exact value is never needed. The closer
+// child is searched first, which tightens a k-NN limit early
+void vptree_search(VPSearch* search, int p, int end) {
+    const VPTree* tree = search->tree;
+    int v = tree->point[p];
+    int split = tree->split[p];
+    int has_inner = split > p + 1;
+    int has_outer = end > split;
+    int far = has_outer ? tree->outer_max[p] : has_inner ? tree->inner_max[p] : 0;
+    int limit = vptree_limit(search);
+    int bound = limit >= NO_BOUND - far ? NO_BOUND : limit + far;
+    int d;
+    if (ted_lower_bound(search->query, search->ti_array[v]) > bound) {
+        d = bound + 1;
+    } else {
+        search->computed++;
+        d = tree_edit_dist_bounded(search->query, search->ti_array[v], bound, search->ws);
+    }
+    if (d <= limit) vptree_offer(search, v, d);
+
+    int inner_bound = has_inner ? vptree_child_bound(d, tree->inner_min[p], tree->inner_max[p]) : INT_MAX;
+    int outer_bound = has_outer ? vptree_child_bound(d, tree->outer_min[p], tree->outer_max[p]) : INT_MAX;
+    if (inner_bound <= outer_bound) {
+        if (inner_bound <= vptree_limit(search)) vptree_search(search, p + 1, split);
+        if (outer_bound <= vptree_limit(search)) vptree_search(search, split, end);
+    } else {
+        if (outer_bound <= vptree_limit(search)) vptree_search(search, split, end);
+        if (inner_bound <= vptree_limit(search)) vptree_search(search, p + 1, split);
+    }
+}
+
+// Frees the input set, whether parsed from text or loaded from an index
+void free_input_set(char** structures, TreeInfo** ti_array, int* rep, int num_structures, StructureIndex* index) {
+    if (!index) {
+        for (int i = 0; i < num_structures; i++) {
+            if (rep[i] == i) free_tree_info(ti_array[i]);
+        }
+    }
+    free_structures(structures, num_structures);
+    free(ti_array);
+    free(rep);
+    free_structure_index(index);
+}
+
+// Reads one structure per line until end of input or the first empty line.
+// The input is read in chunks of up to READ_CHUNK_SIZE with read(), which
+// returns early on terminals and pipes, and split on newlines as it
+// arrives, so lines can have any length and interactive input still ends at
+// an empty line; all strings share one buffer that starts at
+// structures[0] (see free_structures). Returns a possibly empty array and
+// its length in num_structures
+char** read_structures(FILE* in, int* num_structures) {
+    size_t capacity = READ_CHUNK_SIZE;
+    size_t len = 0;
+    char* text = malloc(capacity + 1);
+    int line_capacity = INITIAL_CAPACITY;
+    size_t* line_start = malloc(line_capacity * sizeof(size_t));
+    if (!text || !line_start) {
+        fprintf(stderr, "Memory allocation failed for structures\n");
+        exit(1);
+    }
+    int count = 0;
+    size_t scan = 0; // Start of the line being scanned
+    int done = 0;
+    while (!done) {
+        if (capacity - len < READ_CHUNK_SIZE) {
+            capacity *= 2;
+            text = realloc(text, capacity + 1);
+            if (!text) {
+                fprintf(stderr, "Memory reallocation failed for structures\n");
+                exit(1);
+            }
+        }
+        ssize_t got = read(fileno(in), text + len, READ_CHUNK_SIZE);
+        if (got < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "Failed to read input\n");
+            exit(1);
+        }
+        int at_end = got == 0;
+        len += got;
+        // Complete lines in the new data; at the end of input the rest is
+        // a final line without a newline
+        while (scan < len) {
+            char* newline = memchr(text + scan, '\n', len - scan);
+            if (!newline && !at_end) break;
+            size_t end = newline ? (size_t)(newline - text) : len;
+            if (end == scan) {
+                done = 1; // An empty line ends the input
+                break;
+            }
+            if (count >= line_capacity) {
+                line_capacity *= 2;
+                line_start = realloc(line_start, line_capacity * sizeof(size_t));
+                if (!line_start) {
+                    fprintf(stderr, "Memory reallocation failed for structures\n");
+                    exit(1);
+                }
+            }
+            line_start[count++] = scan;
+            text[end] = 0;
+            scan = end + 1;
+        }
+        if (at_end) done = 1;
+    }
+    // Terminates a last line that filled the buffer exactly
+    text[len] = 0;
+
+    char** structures = malloc((count > 0 ? count : 1) * sizeof(char*));
+    if (!structures) {
+        fprintf(stderr, "Memory allocation failed for structures\n");
+        exit(1);
+    }
+    for (int i = 0; i < count; i++) {
+        structures[i] = text + line_start[i];
+    }
+    if (count == 0) free(text);
+    free(line_start);
+    *num_structures = count;
+    return structures;
+}
+
+void free_structures(char** structures, int num_structures) {
+    if (!structures) return;
+    if (num_structures > 0) free(structures[0]);
+    free(structures);
+}
+
+// Parses every representative once; duplicates share its TreeInfo. The
+// algorithm selects left-path trees, mirrored trees, or both (auto).
+// Returns the largest node count in max_nodes
+TreeInfo** build_tree_infos(char** structures, int num_structures, const int* rep, int algorithm, int* max_nodes) {
+    TreeInfo** ti_array = malloc(num_structures * sizeof(TreeInfo*));
+    if (!ti_array) {
+        fprintf(stderr, "Memory allocation failed for tree info array\n");
+        exit(1);
+    }
+    int largest = 0;
+    // The first failing line (in input order) is reported
+    int error_line = num_structures;
+    RnatedStatus error_status = RNATED_OK;
+    size_t error_pos = 0;
+    #pragma omp parallel for schedule(dynamic, 64) reduction(max:largest)
+    for (int i = 0; i < num_structures; i++) {
+        if (rep[i] != i) continue;
+        size_t pos = 0;
+        RnatedStatus status = rnated_parse(structures[i], strlen(structures[i]), algorithm, &ti_array[i], &pos);
+        if (status != RNATED_OK) {
+            #pragma omp critical
+            if (i < error_line) {
+                error_line = i;
+                error_status = status;
+                error_pos = pos;
+            }
+            continue;
+        }
+        if (ti_array[i]->postorder_size > largest) largest = ti_array[i]->postorder_size;
+    }
+    if (error_line < num_structures) {
+        const char* db = structures[error_line];
+        if (error_status == RNATED_ERROR_INVALID_CHARACTER) {
+            fprintf(stderr, "Invalid character '%c' in %s at position %zu\n", db[error_pos], db, error_pos);
+        } else if (error_status == RNATED_ERROR_UNMATCHED_CLOSE) {
+            fprintf(stderr, "Unmatched closing parenthesis in %s at position %zu\n", db, error_pos);
+        } else if (error_status == RNATED_ERROR_UNBALANCED) {
+            fprintf(stderr, "Unbalanced parentheses in %s\n", db);
+        } else {
+            fprintf(stderr, "Memory allocation failed for TreeInfo\n");
+        }
+        exit(1);
+    }
+    for (int i = 0; i < num_structures; i++) {
+        if (rep[i] != i) ti_array[i] = ti_array[rep[i]];
+    }
+    *max_nodes = largest;
+    return ti_array;
+}
+
+// Reads, deduplicates and parses the structures of a query file, like the
+// main input
+char** read_query_set(const char* path, int algorithm, int* num_queries, int* num_unique_queries, int** query_rep,
+                      TreeInfo*** query_ti, int* max_nodes) {
+    FILE* query_file = fopen(path, "r");
+    if (!query_file) {
+        fprintf(stderr, "Failed to open query file %s\n", path);
+        exit(1);
+    }
+    stats_phase(run_stats, PHASE_READ);
+    char** queries = read_structures(query_file, num_queries);
+    fclose(query_file);
+    stats_phase(run_stats, PHASE_DEDUP);
+    if (*num_queries == 0) {
+        fprintf(stderr, "No query structures provided.\n");
+        exit(1);
+    }
+    *query_rep = malloc(*num_queries * sizeof(int));
+    if (!*query_rep) {
+        fprintf(stderr, "Memory allocation failed for duplicate map\n");
+        exit(1);
+    }
+    *num_unique_queries = find_duplicates(queries, *num_queries, *query_rep);
+    if (*num_unique_queries < *num_queries) {
+        fprintf(stderr, "%d unique query structures among %d\n", *num_unique_queries, *num_queries);
+    }
+    stats_phase(run_stats, PHASE_PARSE);
+    *query_ti = build_tree_infos(queries, *num_queries, *query_rep, algorithm, max_nodes);
+    return queries;
+}
+
+// splitmix64
+uint64_t sample_random(uint64_t* state) {
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+MedoidCache* create_medoid_cache(size_t budget_bytes, int num_points) {
+    MedoidCache* cache = malloc(sizeof(MedoidCache));
+    if (!cache) {
+        fprintf(stderr, "Memory allocation failed for medoid cache\n");
+        exit(1);
+    }
+    size_t column_bytes = (size_t)(num_points > 0 ? num_points : 1) * sizeof(int32_t);
+    size_t capacity = budget_bytes / column_bytes;
+    if (capacity < 1) capacity = 1;
+    if (capacity > INT_MAX / 2) capacity = INT_MAX / 2;
+    cache->capacity = (int)capacity;
+    cache->num_points = num_points;
+    cache->clock = 0;
+    cache->medoid = malloc(capacity * sizeof(int32_t));
+    cache->last_used = calloc(capacity, sizeof(long long));
+    // Columns are allocated as they are first used
+    cache->columns = NULL;
+    if (!cache->medoid || !cache->last_used) {
+        fprintf(stderr, "Memory allocation failed for medoid cache\n");
+        exit(1);
+    }
+    for (size_t c = 0; c < capacity; c++) {
+        cache->medoid[c] = -1;
+    }
+    return cache;
+}
+
+void free_medoid_cache(MedoidCache* cache) {
+    if (!cache) return;
+    free(cache->medoid);
+    free(cache->last_used);
+    free(cache->columns);
+    free(cache);
+}
+
+// Column of distances to medoid; cached is set if it holds values from an
+// earlier use, otherwise the least recently used column is handed over
+int32_t* medoid_cache_column(MedoidCache* cache, int medoid, int* cached) {
+    int slot = 0;
+    int used = 0;
+    for (int c = 0; c < cache->capacity; c++) {
+        if (cache->medoid[c] == medoid) {
+            slot = c;
+            used = 1;
+            break;
+        }
+        if (cache->medoid[c] < 0) {
+            slot = c;
+            break;
+        }
+        if (cache->last_used[c] < cache->last_used[slot]) slot = c;
+    }
+    if (!used && cache->medoid[slot] < 0) {
+        // Grows the column storage up to the first unused slot
+        int32_t* columns = realloc(cache->columns, (size_t)(slot + 1) * cache->num_points * sizeof(int32_t));
+        if (!columns) {
+            fprintf(stderr, "Memory allocation failed for medoid cache\n");
+            exit(1);
+        }
+        cache->columns = columns;
+    }
+    cache->medoid[slot] = medoid;
+    cache->last_used[slot] = ++cache->clock;
+    *cached = used;
+    return cache->columns + (size_t)slot * cache->num_points;
+}
+
+// Nearest and second nearest medoid of every sample point
+void pam_nearest(const int* dist, int s, const int* medoids, int k, int* near, int* d_near, int* d_second) {
+    for (int i = 0; i < s; i++) {
+        near[i] = 0;
+        d_near[i] = INT_MAX;
+        d_second[i] = INT_MAX;
+        for (int m = 0; m < k; m++) {
+            int d = dist[(size_t)medoids[m] * s + i];
+            if (d < d_near[i]) {
+                d_second[i] = d_near[i];
+                d_near[i] = d;
+                near[i] = m;
+            } else if (d < d_second[i]) {
+                d_second[i] = d;
+            }
+        }
+    }
+}
+
+// Greedy initialisation: the most central point, then repeatedly the point
+// that reduces the weighted total deviation most
+void pam_build(const int* dist, const int* weight, int s, int k, int* medoids) {
+    int* d_near = malloc(s * sizeof(int));
+    char* is_medoid = calloc(s, 1);
+    if (!d_near || !is_medoid) {
+        fprintf(stderr, "Memory allocation failed for k-medoids\n");
+        exit(1);
+    }
+    for (int i = 0; i < s; i++) {
+        d_near[i] = INT_MAX;
+    }
+    for (int c = 0; c < k; c++) {
+        int best = 0;
+        int64_t best_cost = INT64_MAX;
+        for (int x = 0; x < s; x++) {
+            if (is_medoid[x]) continue;
+            int64_t cost = 0;
+            for (int i = 0; i < s; i++) {
+                int d = dist[(size_t)x * s + i];
+                cost += (int64_t)weight[i] * (d < d_near[i] ? d : d_near[i]);
+            }
+            if (cost < best_cost) {
+                best_cost = cost;
+                best = x;
+            }
+        }
+        medoids[c] = best;
+        is_medoid[best] = 1;
+        for (int i = 0; i < s; i++) {
+            int d = dist[(size_t)best * s + i];
+            if (d < d_near[i]) d_near[i] = d;
+        }
+    }
+    free(d_near);
+    free(is_medoid);
+}
+
+// Swap phase in the style of FasterPAM: the change of the total deviation
+// for exchanging any medoid with candidate x is found in one pass over the
+// points, using each point's nearest and second nearest medoid. Blocks of
+// MEDOID_SWAP_BLOCK candidates are evaluated in parallel and the best
+// improving swap of a block is applied at once; the search ends after a
+// full round of candidates without improvement. Returns the deviation
+int64_t pam_swap(const int* dist, const int* weight, int s, int k, int* medoids, int num_threads) {
+    int* near = malloc(s * sizeof(int));
+    int* d_near = malloc(s * sizeof(int));
+    int* d_second = malloc(s * sizeof(int));
+    int64_t* loss = malloc(k * sizeof(int64_t));
+    char* is_medoid = calloc(s, 1);
+    if (!near || !d_near || !d_second || !loss || !is_medoid) {
+        fprintf(stderr, "Memory allocation failed for k-medoids\n");
+        exit(1);
+    }
+    for (int m = 0; m < k; m++) {
+        is_medoid[medoids[m]] = 1;
+    }
+    pam_nearest(dist, s, medoids, k, near, d_near, d_second);
+
+    int next = 0;
+    int without_swap = 0;
+    while (k < s && without_swap < s) {
+        // Deviation added by removing each medoid, all else unchanged
+        for (int m = 0; m < k; m++) {
+            loss[m] = 0;
+        }
+        for (int i = 0; i < s; i++) {
+            if (k > 1) loss[near[i]] += (int64_t)weight[i] * (d_second[i] - d_near[i]);
+        }
+        int block = s - without_swap < MEDOID_SWAP_BLOCK ? s - without_swap : MEDOID_SWAP_BLOCK;
+        int64_t best_change = 0;
+        int best_x = -1;
+        int best_m = -1;
+        #pragma omp parallel num_threads(num_threads)
+        {
+            int64_t* delta = malloc(k * sizeof(int64_t));
+            if (!delta) {
+                fprintf(stderr, "Memory allocation failed for k-medoids\n");
                 exit(1);
             }
-            row[i] = 0; // Distance to itself is 0
-            for (int j = 0; j < num_structures; j++) {
-                if (j != i) {
-                    int ted = tree_edit_dist(ti_array[i], ti_array[j]);
-                    row[j] = ted;
+            int64_t local_change = 0;
+            int local_x = -1;
+            int local_m = -1;
+            #pragma omp for schedule(dynamic)
+            for (int b = 0; b < block; b++) {
+                int x = (next + b) % s;
+                if (is_medoid[x]) continue;
+                memcpy(delta, loss, k * sizeof(int64_t));
+                int64_t shared = 0;
+                const int* row = dist + (size_t)x * s;
+                for (int i = 0; i < s; i++) {
+                    int d = row[i];
+                    if (d < d_near[i]) {
+                        // i moves to x whichever medoid is removed
+                        shared += (int64_t)weight[i] * (d - d_near[i]);
+                        if (k > 1) delta[near[i]] += (int64_t)weight[i] * (d_near[i] - d_second[i]);
+                    } else if (k == 1) {
+                        // Without a second medoid, i can only move to x
+                        delta[0] += (int64_t)weight[i] * (d - d_near[i]);
+                    } else if (d < d_second[i]) {
+                        delta[near[i]] += (int64_t)weight[i] * (d - d_second[i]);
+                    }
+                }
+                int m = 0;
+                for (int c = 1; c < k; c++) {
+                    if (delta[c] < delta[m]) m = c;
+                }
+                int64_t change = shared + delta[m];
+                if (change < local_change || (change == local_change && change < 0 && x < local_x)) {
+                    local_change = change;
+                    local_x = x;
+                    local_m = m;
+                }
+            }
+            #pragma omp critical(pam_swap)
+            {
+                if (local_x >= 0 && (local_change < best_change || (local_change == best_change && local_x < best_x))) {
+                    best_change = local_change;
+                    best_x = local_x;
+                    best_m = local_m;
+                }
+            }
+            free(delta);
+        }
+        next = (next + block) % s;
+        if (best_x >= 0) {
+            is_medoid[medoids[best_m]] = 0;
+            medoids[best_m] = best_x;
+            is_medoid[best_x] = 1;
+            pam_nearest(dist, s, medoids, k, near, d_near, d_second);
+            without_swap = 0;
+        } else {
+            without_swap += block;
+        }
+    }
+
+    int64_t deviation = 0;
+    for (int i = 0; i < s; i++) {
+        deviation += (int64_t)weight[i] * d_near[i];
+    }
+    free(near);
+    free(d_near);
+    free(d_second);
+    free(loss);
+    free(is_medoid);
+    return deviation;
+}
+
+// Assigns every point to its nearest medoid (ties to the earlier medoid)
+// and returns the weighted total deviation. Medoids are visited one at a
+// time and each distance is capped at the point's best distance so far,
+// so later medoids mostly run the cheap banded DP. Cached columns are
+// reused; a cached lower bound above the cap answers without a DP. Each of
+// the pool_size threads uses its own workspace of pool
+int64_t assign_to_medoids(TreeInfo** ti_array, const int* points, const int* weight, int num_points, const int* medoids, int k,
+                          MedoidCache* cache, Workspace** pool, int pool_size, int* nearest, int* nearest_dist, long long* computed) {
+    for (int u = 0; u < num_points; u++) {
+        nearest[u] = -1;
+        nearest_dist[u] = NO_BOUND;
+    }
+    long long dps = 0;
+    for (int m = 0; m < k; m++) {
+        int cached;
+        int32_t* column = medoid_cache_column(cache, medoids[m], &cached);
+        TreeInfo* medoid = ti_array[points[medoids[m]]];
+        #pragma omp parallel num_threads(pool_size) reduction(+:dps)
+        {
+            Workspace* ws = pool[omp_get_thread_num()];
+            #pragma omp for schedule(dynamic, 64)
+            for (int u = 0; u < num_points; u++) {
+                int bound = nearest_dist[u];
+                int d;
+                if (cached && column[u] >= 0) {
+                    d = column[u];
+                } else if (cached && -column[u] > bound) {
+                    d = -column[u];
+                } else {
+                    dps++;
+                    d = bound == NO_BOUND ? tree_edit_dist(ti_array[points[u]], medoid, ws)
+                                          : tree_edit_dist_bounded(ti_array[points[u]], medoid, bound, ws);
+                    column[u] = d > bound ? -d : d;
+                }
+                if (d < nearest_dist[u]) {
+                    nearest_dist[u] = d;
+                    nearest[u] = medoids[m];
+                }
+            }
+        }
+    }
+    int64_t deviation = 0;
+    for (int u = 0; u < num_points; u++) {
+        deviation += (int64_t)weight[u] * nearest_dist[u];
+    }
+    *computed += dps;
+    return deviation;
+}
+
+int main(int argc, char* argv[]) {
+    int opt;
+    int num_threads = omp_get_max_threads();
+    int row_wise = 0;  // Default to full matrix mode
+    int first_only = 0; // New option to compare only the first structure
+    int block_rows = DEFAULT_BLOCK_ROWS;
+    int format = FORMAT_MATRIX;
+    int dtype_size = 4;
+    const char* output_path = NULL;
+    int resume = 0;
+    double checkpoint_interval = DEFAULT_CHECKPOINT_INTERVAL;
+    int max_dist = -1;
+    int knn = 0;
+    const char* reference_path = NULL;
+    const char* query_path = NULL;
+    int algorithm = RNATED_ALGORITHM_AUTO;
+    double cache_size_mb = 0;
+    const char* index_path = NULL;
+    const char* build_index_path = NULL;
+    int shard_index = 0;
+    int num_shards = 0;
+    const char* stats_path = NULL;
+    double stats_interval = 0;
+    const char* extend_path = NULL;
+    const char* build_vptree_path = NULL;
+    const char* vptree_path = NULL;
+    int num_medoids = 0;
+    int num_samples = DEFAULT_MEDOID_SAMPLES;
+    int sample_size = 0;
+    double medoid_cache_mb = DEFAULT_MEDOID_CACHE_MB;
+
+    if (argc > 1 && strcmp(argv[1], "merge") == 0) {
+        return merge_shards(argc - 1, argv + 1);
+    }
+
+    struct option long_options[] = {
+        {"help", no_argument, 0, 'h'},
+        {"version", no_argument, 0, 'v'},
+        {"threads", required_argument, 0, 't'},
+        {"row-wise", no_argument, 0, 'r'},
+        {"first-only", no_argument, 0, 'f'}, // New option
+        {"block-rows", required_argument, 0, 'b'},
+        {"format", required_argument, 0, 'F'},
+        {"dtype", required_argument, 0, 'D'},
+        {"output", required_argument, 0, 'o'},
+        {"resume", no_argument, 0, 'R'},
+        {"checkpoint-interval", required_argument, 0, 'c'},
+        {"max-dist", required_argument, 0, 'k'},
+        {"knn", required_argument, 0, 'n'},
+        {"reference", required_argument, 0, 'd'},
+        {"query", required_argument, 0, 'q'},
+        {"algorithm", required_argument, 0, 'a'},
+        {"cache-size", required_argument, 0, 'm'},
+        {"index", required_argument, 0, 'i'},
+        {"build-index", required_argument, 0, 'B'},
+        {"shard", required_argument, 0, 'S'},
+        {"stats", required_argument, 0, 's'},
+        {"stats-interval", required_argument, 0, 'I'},
+        {"extend", required_argument, 0, 'e'},
+        {"build-vptree", required_argument, 0, 'V'},
+        {"vptree", required_argument, 0, 'P'},
+        {"medoids", required_argument, 0, 'K'},
+        {"samples", required_argument, 0, 'N'},
+        {"sample-size", required_argument, 0, 'Z'},
+        {"medoid-cache", required_argument, 0, 'C'},
+        {0, 0, 0, 0}
+    };
+
+    while ((opt = getopt_long(argc, argv, "hvt:rfb:F:D:o:Rc:k:n:d:q:a:m:i:B:S:s:I:e:V:P:K:N:Z:C:", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'h':
+                printf("Usage: %s [options]\n", argv[0]);
+                printf("Options:\n");
+                printf("  --help, -h         Display this help message\n");
+                printf("  --version, -v      Display version information\n");
+                printf("  --threads, -t      Set number of threads (default: %d)\n", num_threads);
+                printf("  --row-wise, -r     Output the distance matrix row by row (memory-efficient)\n");
+                printf("  --first-only, -f   Compute distances only for the first structure against all others\n");
+                printf("  --block-rows, -b   Rows computed per block in row-wise mode (default: %d)\n", DEFAULT_BLOCK_ROWS);
+                printf("  --format, -F       Matrix output format: matrix, condensed or binary (default: matrix)\n");
+                printf("  --dtype, -D        Value type for binary output: uint16 or uint32 (default: uint32)\n");
+                printf("  --output, -o       Write output to a file instead of standard output; binary\n");
+                printf("                     full-matrix output is memory-mapped and filled in place\n");
+                printf("  --checkpoint-interval, -c\n");
+                printf("                     Seconds between checkpoints of memory-mapped output (default: %d, 0 disables)\n", DEFAULT_CHECKPOINT_INTERVAL);
+                printf("  --resume, -R       Continue an interrupted memory-mapped run from its checkpoint\n");
+                printf("  --max-dist, -k     Only report pairs with distance <= K, as \"i j distance\" lines\n");
+                printf("  --knn, -n          Report the K nearest neighbours of every structure, as \"i j distance\" lines\n");
+                printf("  --reference, -d    Read reference structures from a file instead of standard input\n");
+                printf("  --query, -q        Compare the structures in this file against the references\n");
+                printf("                     (one output row per query, one column per reference)\n");
+                printf("  --algorithm, -a    Decomposition: auto, left or right (default: auto, cheaper of both per pair)\n");
+                printf("  --cache-size, -m   Megabytes for reusing results of recurring substructures (default: 0, off)\n");
+                printf("  --build-index, -B  Parse the input once, write it to a binary index file and exit\n");
+                printf("  --index, -i        Load the (reference) structures from an index file instead of text\n");
+                printf("  --shard, -S        Compute only shard K of N (K/N, 0 <= K < N) of the full matrix into the\n");
+                printf("                     --output file; combine the shards with \"%s merge\"\n", argv[0]);
+                printf("  --stats, -s        Write run statistics as JSON to a file (- for standard error)\n");
+                printf("  --stats-interval, -I  Seconds between intermediate statistics (default: 0, only at exit)\n");
+                printf("  --extend, -e       Extend this binary matrix of the first input structures to all of\n");
+                printf("                     them, in place or into the --output file\n");
+                printf("  --build-vptree, -V Build a vantage-point tree over the input structures, write it to a file and exit\n");
+                printf("  --vptree, -P       Answer --query with --max-dist (range) or --knn using this vantage-point tree\n");
+                printf("  --medoids, -K      Cluster the structures around K medoids, as \"i medoid distance\" lines\n");
+                printf("  --samples, -N      Samples clustered in --medoids mode (default: %d)\n", DEFAULT_MEDOID_SAMPLES);
+                printf("  --sample-size, -Z  Distinct structures per sample (default: 80 + 4K)\n");
+                printf("  --medoid-cache, -C Megabytes for distances to medoids reused between samples (default: %d)\n", DEFAULT_MEDOID_CACHE_MB);
+                printf("\nThe program reads RNA secondary structures in dot-bracket notation\n");
+                printf("from standard input, one per line, and outputs either a distance matrix\n");
+                printf("or distances for the first structure based on tree edit distance.\n");
+                return 0;
+            case 'v':
+                printf("Version: %s\n", VERSION);
+                return 0;
+            case 't':
+                num_threads = atoi(optarg);
+                if (num_threads <= 0) {
+                    fprintf(stderr, "Invalid number of threads: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'r':
+                row_wise = 1;
+                break;
+            case 'f':
+                first_only = 1;
+                break;
+            case 'b':
+                block_rows = atoi(optarg);
+                if (block_rows <= 0) {
+                    fprintf(stderr, "Invalid number of block rows: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'F':
+                if (strcmp(optarg, "matrix") == 0) {
+                    format = FORMAT_MATRIX;
+                } else if (strcmp(optarg, "condensed") == 0) {
+                    format = FORMAT_CONDENSED;
+                } else if (strcmp(optarg, "binary") == 0) {
+                    format = FORMAT_BINARY;
+                } else {
+                    fprintf(stderr, "Invalid output format: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'D':
+                if (strcmp(optarg, "uint16") == 0) {
+                    dtype_size = 2;
+                } else if (strcmp(optarg, "uint32") == 0) {
+                    dtype_size = 4;
+                } else {
+                    fprintf(stderr, "Invalid binary value type: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'o':
+                output_path = optarg;
+                break;
+            case 'R':
+                resume = 1;
+                break;
+            case 'k':
+                max_dist = atoi(optarg);
+                if (max_dist < 0 || strspn(optarg, "0123456789") != strlen(optarg)) {
+                    fprintf(stderr, "Invalid maximum distance: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'n':
+                knn = atoi(optarg);
+                if (knn <= 0 || strspn(optarg, "0123456789") != strlen(optarg)) {
+                    fprintf(stderr, "Invalid number of nearest neighbours: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'd':
+                reference_path = optarg;
+                break;
+            case 'q':
+                query_path = optarg;
+                break;
+            case 'a':
+                if (strcmp(optarg, "auto") == 0) {
+                    algorithm = RNATED_ALGORITHM_AUTO;
+                } else if (strcmp(optarg, "left") == 0) {
+                    algorithm = RNATED_ALGORITHM_LEFT;
+                } else if (strcmp(optarg, "right") == 0) {
+                    algorithm = RNATED_ALGORITHM_RIGHT;
+                } else {
+                    fprintf(stderr, "Invalid algorithm: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'm':
+                cache_size_mb = atof(optarg);
+                if (cache_size_mb < 0) {
+                    fprintf(stderr, "Invalid cache size: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'i':
+                index_path = optarg;
+                break;
+            case 'B':
+                build_index_path = optarg;
+                break;
+            case 'S': {
+                char* slash = strchr(optarg, '/');
+                shard_index = atoi(optarg);
+                num_shards = slash ? atoi(slash + 1) : 0;
+                if (!slash || strspn(optarg, "0123456789") != (size_t)(slash - optarg) ||
+                    num_shards <= 0 || shard_index < 0 || shard_index >= num_shards) {
+                    fprintf(stderr, "Invalid shard, expected K/N with 0 <= K < N: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            }
+            case 's':
+                stats_path = optarg;
+                break;
+            case 'e':
+                extend_path = optarg;
+                break;
+            case 'V':
+                build_vptree_path = optarg;
+                break;
+            case 'P':
+                vptree_path = optarg;
+                break;
+            case 'K':
+                num_medoids = atoi(optarg);
+                if (num_medoids <= 0 || strspn(optarg, "0123456789") != strlen(optarg)) {
+                    fprintf(stderr, "Invalid number of medoids: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'N':
+                num_samples = atoi(optarg);
+                if (num_samples <= 0 || strspn(optarg, "0123456789") != strlen(optarg)) {
+                    fprintf(stderr, "Invalid number of samples: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'Z':
+                sample_size = atoi(optarg);
+                if (sample_size <= 0 || strspn(optarg, "0123456789") != strlen(optarg)) {
+                    fprintf(stderr, "Invalid sample size: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'C':
+                medoid_cache_mb = atof(optarg);
+                if (medoid_cache_mb < 0) {
+                    fprintf(stderr, "Invalid medoid cache size: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'I':
+                stats_interval = atof(optarg);
+                if (stats_interval < 0) {
+                    fprintf(stderr, "Invalid statistics interval: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'c':
+                checkpoint_interval = atof(optarg);
+                if (checkpoint_interval < 0) {
+                    fprintf(stderr, "Invalid checkpoint interval: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            default:
+                fprintf(stderr, "Invalid option. Use --help for usage information.\n");
+                return 1;
+        }
+    }
+
+    if (max_dist >= 0 && (first_only || row_wise || resume || format != FORMAT_MATRIX)) {
+        fprintf(stderr, "--max-dist cannot be combined with --first-only, --row-wise, --resume or --format\n");
+        return 1;
+    }
+    if (knn > 0 && (max_dist >= 0 || first_only || row_wise || resume || format != FORMAT_MATRIX)) {
+        fprintf(stderr, "--knn cannot be combined with --max-dist, --first-only, --row-wise, --resume or --format\n");
+        return 1;
+    }
+    if (query_path && ((!vptree_path && (max_dist >= 0 || knn > 0)) || first_only || row_wise || resume || format != FORMAT_MATRIX)) {
+        fprintf(stderr, "--query cannot be combined with --max-dist or --knn (except with --vptree), --first-only, --row-wise, --resume or --format\n");
+        return 1;
+    }
+    if (vptree_path && (!query_path || (max_dist >= 0) == (knn > 0))) {
+        fprintf(stderr, "--vptree requires --query and either --max-dist or --knn\n");
+        return 1;
+    }
+    if (build_vptree_path && (max_dist >= 0 || knn > 0 || query_path || first_only || row_wise || resume || num_shards > 0 ||
+                              extend_path || format != FORMAT_MATRIX || build_index_path)) {
+        fprintf(stderr, "--build-vptree cannot be combined with --max-dist, --knn, --query, --first-only, --row-wise, --resume, --shard, --extend, --format or --build-index\n");
+        return 1;
+    }
+    if (num_medoids > 0 && (max_dist >= 0 || knn > 0 || query_path || first_only || row_wise || resume || num_shards > 0 ||
+                            extend_path || format != FORMAT_MATRIX || build_index_path || build_vptree_path)) {
+        fprintf(stderr, "--medoids cannot be combined with --max-dist, --knn, --query, --first-only, --row-wise, --resume, --shard, --extend, --format, --build-index or --build-vptree\n");
+        return 1;
+    }
+    if (sample_size > 0 && sample_size <= num_medoids) {
+        fprintf(stderr, "--sample-size must be larger than the number of medoids\n");
+        return 1;
+    }
+    if (query_path && !reference_path && !index_path) {
+        fprintf(stderr, "--query requires --reference or --index\n");
+        return 1;
+    }
+    if (num_shards > 0 && (max_dist >= 0 || knn > 0 || query_path || first_only || row_wise || resume || format != FORMAT_MATRIX)) {
+        fprintf(stderr, "--shard cannot be combined with --max-dist, --knn, --query, --first-only, --row-wise, --resume or --format\n");
+        return 1;
+    }
+    if (num_shards > 0 && !output_path) {
+        fprintf(stderr, "--shard requires --output\n");
+        return 1;
+    }
+    if (extend_path && (max_dist >= 0 || knn > 0 || query_path || first_only || row_wise || resume || num_shards > 0 ||
+                        format != FORMAT_MATRIX || index_path || build_index_path)) {
+        fprintf(stderr, "--extend cannot be combined with --max-dist, --knn, --query, --first-only, --row-wise, --resume, --shard, --format, --index or --build-index\n");
+        return 1;
+    }
+    if (index_path && (reference_path || build_index_path)) {
+        fprintf(stderr, "--index cannot be combined with --reference or --build-index\n");
+        return 1;
+    }
+    if (first_only && format != FORMAT_MATRIX) {
+        fprintf(stderr, "--format only applies to distance matrix output, not --first-only\n");
+        return 1;
+    }
+
+    omp_set_num_threads(num_threads);
+    if (cache_size_mb > 0) {
+        subtree_cache = create_subtree_cache((size_t)(cache_size_mb * 1048576));
+        if (!subtree_cache) {
+            fprintf(stderr, "Memory allocation failed for subtree cache\n");
+            return 1;
+        }
+    }
+    if (stats_path) {
+        FILE* stats_out = strcmp(stats_path, "-") == 0 ? stderr : fopen(stats_path, "w");
+        if (!stats_out) {
+            fprintf(stderr, "Failed to open statistics file %s\n", stats_path);
+            return 1;
+        }
+        run_stats = create_run_stats(stats_out, stats_interval, num_threads);
+        run_stats->mode = build_index_path ? "build_index" : build_vptree_path ? "build_vptree" : vptree_path ? "vptree_query"
+                        : max_dist >= 0 ? "max_dist" : knn > 0 ? "knn"
+                        : query_path ? "query" : first_only ? "first_only" : row_wise ? "row_wise"
+                        : num_shards > 0 ? "shard" : extend_path ? "extend" : num_medoids > 0 ? "kmedoids" : "full";
+    }
+
+    int num_structures;
+    char** structures = NULL;
+    int* rep;
+    int num_unique;
+    int max_nodes;
+    TreeInfo** ti_array;
+    uint64_t input_hash;
+    StructureIndex* index = NULL;
+    stats_phase(run_stats, PHASE_READ);
+    if (index_path) {
+        index = load_structure_index(index_path, algorithm);
+        num_structures = index->num_structures;
+        num_unique = index->num_unique;
+        rep = index->rep;
+        ti_array = index->ti_array;
+        max_nodes = index->max_nodes;
+        input_hash = index->input_hash;
+    } else {
+        FILE* input = stdin;
+        if (reference_path) {
+            input = fopen(reference_path, "r");
+            if (!input) {
+                fprintf(stderr, "Failed to open reference file %s\n", reference_path);
+                return 1;
+            }
+        }
+        structures = read_structures(input, &num_structures);
+        if (input != stdin) fclose(input);
+        stats_phase(run_stats, PHASE_DEDUP);
+        if (num_structures == 0) {
+            fprintf(stderr, "No structures provided.\n");
+            free_structures(structures, num_structures);
+            return 1;
+        }
+
+        // Identical structures are parsed and compared only once; every other
+        // occurrence shares the TreeInfo of its representative and its
+        // distances are copied from the representative's
+        rep = malloc(num_structures * sizeof(int));
+        if (!rep) {
+            fprintf(stderr, "Memory allocation failed for duplicate map\n");
+            return 1;
+        }
+        num_unique = find_duplicates(structures, num_structures, rep);
+        input_hash = hash_structures(structures, num_structures);
+        stats_phase(run_stats, PHASE_PARSE);
+        // An index holds both orientations of every tree
+        ti_array = build_tree_infos(structures, num_structures, rep, build_index_path ? RNATED_ALGORITHM_AUTO : algorithm, &max_nodes);
+    }
+    if (num_unique < num_structures) {
+        fprintf(stderr, "%d unique structures among %d\n", num_unique, num_structures);
+    }
+    if (run_stats) {
+        run_stats->num_structures = num_structures;
+        run_stats->num_unique = num_unique;
+    }
+    if (build_index_path) {
+        stats_phase(run_stats, PHASE_OUTPUT);
+        write_structure_index(build_index_path, ti_array, rep, num_structures, input_hash);
+        free_input_set(structures, ti_array, rep, num_structures, index);
+        finish_run_stats(run_stats);
+        return 0;
+    }
+    stats_phase(run_stats, PHASE_DISTANCE);
+    if (build_vptree_path) {
+        VPTree* tree = build_vptree(ti_array, rep, num_structures, num_unique, max_nodes, num_threads);
+        stats_phase(run_stats, PHASE_OUTPUT);
+        write_vptree(build_vptree_path, tree, num_structures, input_hash);
+        free_vptree(tree);
+        free_input_set(structures, ti_array, rep, num_structures, index);
+        finish_run_stats(run_stats);
+        return 0;
+    }
+
+    TextWriter* writer = malloc(sizeof(TextWriter));
+    if (!writer) {
+        fprintf(stderr, "Memory allocation failed for output buffer\n");
+        return 1;
+    }
+    writer->out = stdout;
+    writer->len = 0;
+    // Binary full-matrix output is written through a file mapping instead
+    int mapped_output = output_path && format == FORMAT_BINARY && !row_wise && !first_only && max_dist < 0 && knn == 0 && !query_path && num_shards == 0;
+    if (resume && !mapped_output) {
+        fprintf(stderr, "--resume requires full-matrix mode with --format binary and --output\n");
+        return 1;
+    }
+    if (output_path && !mapped_output && !extend_path) {
+        writer->out = fopen(output_path, "wb");
+        if (!writer->out) {
+            fprintf(stderr, "Failed to open output file %s\n", output_path);
+            return 1;
+        }
+    }
+
+    if (vptree_path) {
+        // Range (--max-dist) or k-nearest-neighbour (--knn) search for every
+        // query in a vantage-point tree over the references. Subtrees that
+        // the triangle inequality rules out are skipped without computing a
+        // distance; lines are "query reference distance", ordered by
+        // reference for range queries and by distance for k-NN
+        VPTree* tree = load_vptree(vptree_path, rep, num_structures, input_hash);
+        int num_queries, num_unique_queries, query_max_nodes;
+        int* query_rep;
+        TreeInfo** query_ti;
+        char** queries = read_query_set(query_path, algorithm, &num_queries, &num_unique_queries, &query_rep, &query_ti, &query_max_nodes);
+        if (query_max_nodes > max_nodes) max_nodes = query_max_nodes;
+        stats_phase(run_stats, PHASE_DISTANCE);
+
+        int* member_start = calloc(num_structures + 1, sizeof(int));
+        int* members = malloc(num_structures * sizeof(int));
+        int* member_fill = malloc(num_structures * sizeof(int));
+        Neighbor** found = calloc(num_queries, sizeof(Neighbor*));
+        int* found_count = calloc(num_queries, sizeof(int));
+        if (!member_start || !members || !member_fill || !found || !found_count) {
+            fprintf(stderr, "Memory allocation failed for search results\n");
+            return 1;
+        }
+        for (int i = 0; i < num_structures; i++) {
+            member_start[rep[i] + 1]++;
+        }
+        for (int i = 0; i < num_structures; i++) {
+            member_start[i + 1] += member_start[i];
+        }
+        memcpy(member_fill, member_start, num_structures * sizeof(int));
+        for (int i = 0; i < num_structures; i++) {
+            members[member_fill[rep[i]]++] = i;
+        }
+
+        long long computed_pairs = 0;
+        _Atomic int completed_queries = 0;
+        Progress progress = start_progress();
+        #pragma omp parallel reduction(+:computed_pairs)
+        {
+            Workspace* ws = create_thread_workspace(max_nodes);
+            VPSearch search = {tree, ti_array, member_start, members, NULL, ws, max_dist, knn, NULL, 0, 0, 0};
+            #pragma omp for schedule(dynamic)
+            for (int q = 0; q < num_queries; q++) {
+                if (query_rep[q] == q) {
+                    search.query = query_ti[q];
+                    search.count = 0;
+                    search.capacity = knn > 0 ? knn : INITIAL_CAPACITY;
+                    search.found = malloc(search.capacity * sizeof(Neighbor));
+                    if (!search.found) {
+                        fprintf(stderr, "Memory allocation failed for search results\n");
+                        exit(1);
+                    }
+                    if (tree->num_points > 0) vptree_search(&search, 0, tree->num_points);
+                    qsort(search.found, search.count, sizeof(Neighbor), knn > 0 ? compare_neighbor_rank : compare_neighbor_index);
+                    found[q] = search.found;
+                    found_count[q] = search.count;
+                }
+                int done = __atomic_add_fetch(&completed_queries, 1, __ATOMIC_SEQ_CST);
+                report_progress(&progress, (int)((long long)done * 100 / num_queries));
+            }
+            computed_pairs += search.computed;
+            free_workspace(ws);
+        }
+        fprintf(stderr, "\n");
+        stats_phase(run_stats, PHASE_OUTPUT);
+
+        for (int q = 0; q < num_queries; q++) {
+            int a = query_rep[q];
+            for (int k = 0; k < found_count[a]; k++) {
+                write_edge(writer, q, found[a][k].index, found[a][k].distance);
+            }
+        }
+        writer_flush(writer);
+        long long scan_pairs = (long long)num_unique_queries * num_unique;
+        fprintf(stderr, "%lld of %lld distances computed, %.1f%% avoided by the vantage-point tree\n",
+                computed_pairs, scan_pairs, scan_pairs > 0 ? 100.0 * (scan_pairs - computed_pairs) / scan_pairs : 0.0);
+
+        for (int q = 0; q < num_queries; q++) {
+            if (query_rep[q] == q) free_tree_info(query_ti[q]);
+            free(found[q]);
+        }
+        free_structures(queries, num_queries);
+        free(query_ti);
+        free(query_rep);
+        free(found);
+        free(found_count);
+        free(member_start);
+        free(members);
+        free(member_fill);
+        free_vptree(tree);
+    } else if (num_medoids > 0) {
+        // k-medoids in the style of CLARA: each sample of distinct structures
+        // (weighted by their occurrences, always including the best medoids
+        // so far) is clustered on its own small distance matrix, then all
+        // structures are assigned to the sample's medoids. The medoids with
+        // the lowest total deviation over the whole input win. Without a full
+        // matrix this takes samples * (sample_size^2 / 2 + n * K) distances
+        int k = num_medoids;
+        if (k > num_unique) {
+            fprintf(stderr, "--medoids exceeds the number of distinct structures (%d)\n", num_unique);
+            return 1;
+        }
+        int s = sample_size > 0 ? sample_size : 80 + 4 * k;
+        if (s > num_unique) s = num_unique;
+        int samples = s == num_unique ? 1 : num_samples;
+        int* points = malloc(num_unique * sizeof(int));
+        int* weight = calloc(num_unique, sizeof(int));
+        int* point_of = malloc(num_structures * sizeof(int));
+        int* stamp = calloc(num_unique, sizeof(int));
+        int* unsampled = malloc(num_unique * sizeof(int));
+        int* sample = malloc(s * sizeof(int));
+        int* sample_weight = malloc(s * sizeof(int));
+        int* dist = malloc((size_t)s * s * sizeof(int));
+        int* medoids = malloc(k * sizeof(int));
+        int* medoid_points = malloc(k * sizeof(int));
+        int* best_medoids = malloc(k * sizeof(int));
+        int* nearest = malloc(num_unique * sizeof(int));
+        int* nearest_dist = malloc(num_unique * sizeof(int));
+        int* best_nearest = malloc(num_unique * sizeof(int));
+        int* best_dist = malloc(num_unique * sizeof(int));
+        if (!points || !weight || !point_of || !stamp || !unsampled || !sample || !sample_weight || !dist || !medoids || !medoid_points ||
+            !best_medoids || !nearest || !nearest_dist || !best_nearest || !best_dist) {
+            fprintf(stderr, "Memory allocation failed for k-medoids\n");
+            return 1;
+        }
+        int u = 0;
+        for (int i = 0; i < num_structures; i++) {
+            if (rep[i] == i) {
+                points[u] = i;
+                point_of[i] = u++;
+            }
+            point_of[i] = point_of[rep[i]];
+            weight[point_of[i]]++;
+        }
+        MedoidCache* cache = create_medoid_cache((size_t)(medoid_cache_mb * 1048576), num_unique);
+        // One workspace per thread for all samples and medoids
+        Workspace** pool = create_thread_pool(max_nodes, num_threads);
+
+        uint64_t random_state = 0x9E3779B97F4A7C15ULL;
+        int64_t best_deviation = INT64_MAX;
+        long long computed_pairs = 0;
+        Progress progress = start_progress();
+        for (int t = 0; t < samples; t++) {
+            int count = 0;
+            if (s == num_unique) {
+                for (u = 0; u < num_unique; u++) {
+                    sample[count++] = u;
+                }
+            } else {
+                if (t > 0) {
+                    for (int m = 0; m < k; m++) {
+                        stamp[best_medoids[m]] = t + 1;
+                        sample[count++] = best_medoids[m];
+                    }
+                }
+                // Structures are drawn uniformly, so frequent ones are more
+                // likely to be sampled. Rare ones can take very many draws
+                // in a duplicated input, so after a fixed number of draws
+                // the sample is completed uniformly among the distinct
+                // structures not yet in it
+                long long draws = (long long)MEDOID_SAMPLE_DRAWS * s;
+                while (count < s && draws-- > 0) {
+                    u = point_of[sample_random(&random_state) % (uint64_t)num_structures];
+                    if (stamp[u] != t + 1) {
+                        stamp[u] = t + 1;
+                        sample[count++] = u;
+                    }
+                }
+                if (count < s) {
+                    int left = 0;
+                    for (u = 0; u < num_unique; u++) {
+                        if (stamp[u] != t + 1) unsampled[left++] = u;
+                    }
+                    // Partial Fisher-Yates shuffle
+                    while (count < s) {
+                        int pick = (int)(sample_random(&random_state) % (uint64_t)left);
+                        u = unsampled[pick];
+                        unsampled[pick] = unsampled[--left];
+                        stamp[u] = t + 1;
+                        sample[count++] = u;
+                    }
+                }
+            }
+            for (int a = 0; a < s; a++) {
+                sample_weight[a] = weight[sample[a]];
+            }
+
+            #pragma omp parallel for schedule(dynamic) num_threads(num_threads) reduction(+:computed_pairs)
+            for (int a = 0; a < s; a++) {
+                Workspace* ws = pool[omp_get_thread_num()];
+                dist[(size_t)a * s + a] = 0;
+                for (int b = a + 1; b < s; b++) {
+                    int d = tree_edit_dist(ti_array[points[sample[a]]], ti_array[points[sample[b]]], ws);
+                    dist[(size_t)a * s + b] = d;
+                    dist[(size_t)b * s + a] = d;
+                    computed_pairs++;
                 }
             }
-            #pragma omp critical
-            {
-                for (int j = 0; j < num_structures; j++) {
-                    printf("%d ", row[j]);
+            pam_build(dist, sample_weight, s, k, medoids);
+            pam_swap(dist, sample_weight, s, k, medoids, num_threads);
+
+            // Ascending order makes ties go to the lowest structure index
+            for (int m = 0; m < k; m++) {
+                int p = sample[medoids[m]];
+                int c = m;
+                while (c > 0 && medoid_points[c - 1] > p) {
+                    medoid_points[c] = medoid_points[c - 1];
+                    c--;
                 }
-                printf("\n");
-                fflush(stdout);
+                medoid_points[c] = p;
             }
-            free(row);
-            __atomic_fetch_add(&completed_rows, 1, __ATOMIC_SEQ_CST);
-            int percentage = (completed_rows * 100) / num_structures;
-            #pragma omp critical
-            {
-                if (percentage > last_percentage) {
-                    fprintf(stderr, "\rProgress: %d%%", percentage);
-                    fflush(stderr);
-                    last_percentage = percentage;
+            int64_t deviation = 0;
+            if (s == num_unique) {
+                // The sample holds every structure, in order: its matrix has all distances
+                for (u = 0; u < num_unique; u++) {
+                    nearest_dist[u] = NO_BOUND;
+                    for (int m = 0; m < k; m++) {
+                        int d = dist[(size_t)medoid_points[m] * s + u];
+                        if (d < nearest_dist[u]) {
+                            nearest_dist[u] = d;
+                            nearest[u] = medoid_points[m];
+                        }
+                    }
+                    deviation += (int64_t)weight[u] * nearest_dist[u];
                 }
+            } else {
+                deviation = assign_to_medoids(ti_array, points, weight, num_unique, medoid_points, k, cache, pool, num_threads,
+                                              nearest, nearest_dist, &computed_pairs);
+            }
+            if (deviation < best_deviation) {
+                best_deviation = deviation;
+                memcpy(best_medoids, medoid_points, k * sizeof(int));
+                int* swap = best_nearest;
+                best_nearest = nearest;
+                nearest = swap;
+                swap = best_dist;
+                best_dist = nearest_dist;
+                nearest_dist = swap;
             }
+            report_progress(&progress, (int)((long long)(t + 1) * 100 / samples));
         }
         fprintf(stderr, "\n");
-    } else {
-        // Full matrix computation
+        stats_phase(run_stats, PHASE_OUTPUT);
+
+        for (int i = 0; i < num_structures; i++) {
+            u = point_of[i];
+            write_edge(writer, i, points[best_nearest[u]], best_dist[u]);
+        }
+        writer_flush(writer);
+        long long all_pairs = (long long)num_unique * (num_unique - 1) / 2;
+        fprintf(stderr, "%d medoids, total deviation %lld; %lld distances computed (full matrix: %lld)\n",
+                k, (long long)best_deviation, computed_pairs, all_pairs);
+
+        free_medoid_cache(cache);
+        free_workspace_pool(pool, num_threads);
+        free(points);
+        free(weight);
+        free(point_of);
+        free(stamp);
+        free(unsampled);
+        free(sample);
+        free(sample_weight);
+        free(dist);
+        free(medoids);
+        free(medoid_points);
+        free(best_medoids);
+        free(nearest);
+        free(nearest_dist);
+        free(best_nearest);
+        free(best_dist);
+    } else if (max_dist >= 0) {
+        // Sparse neighbour graph: only pairs with distance <= max_dist are
+        // reported. Pairs are first screened with the label-count lower
+        // bound, the rest run the banded DP that gives up beyond max_dist
+        int** row_neighbors = calloc(num_structures, sizeof(int*));
+        int** row_distances = calloc(num_structures, sizeof(int*));
+        int* row_count = calloc(num_structures, sizeof(int));
+        if (!row_neighbors || !row_distances || !row_count) {
+            fprintf(stderr, "Memory allocation failed for neighbour lists\n");
+            return 1;
+        }
+        long long pruned_pairs = 0;
+        long long computed_pairs = 0;
         _Atomic int completed_rows = 0;
-        int last_percentage = -1;
+        Progress progress = start_progress();
+
+        #pragma omp parallel reduction(+:pruned_pairs, computed_pairs)
+        {
+            Workspace* ws = create_thread_workspace(max_nodes);
+            #pragma omp for schedule(dynamic)
+            for (int i = 0; i < num_structures; i++) {
+                if (rep[i] == i) {
+                    int capacity_i = 0;
+                    for (int j = i + 1; j < num_structures; j++) {
+                        if (rep[j] != j) continue;
+                        if (ted_lower_bound(ti_array[i], ti_array[j]) > max_dist) {
+                            pruned_pairs++;
+                            continue;
+                        }
+                        computed_pairs++;
+                        int ted = tree_edit_dist_bounded(ti_array[i], ti_array[j], max_dist, ws);
+                        if (ted > max_dist) continue;
+                        if (row_count[i] == capacity_i) {
+                            capacity_i = capacity_i ? capacity_i * 2 : 16;
+                            row_neighbors[i] = realloc(row_neighbors[i], capacity_i * sizeof(int));
+                            row_distances[i] = realloc(row_distances[i], capacity_i * sizeof(int));
+                            if (!row_neighbors[i] || !row_distances[i]) {
+                                fprintf(stderr, "Memory allocation failed for neighbour lists\n");
+                                exit(1);
+                            }
+                        }
+                        row_neighbors[i][row_count[i]] = j;
+                        row_distances[i][row_count[i]] = ted;
+                        row_count[i]++;
+                    }
+                }
+                __atomic_fetch_add(&completed_rows, 1, __ATOMIC_SEQ_CST);
+                int percentage = (completed_rows * 100) / num_structures;
+                report_progress(&progress, percentage);
+            }
+            free_workspace(ws);
+        }
+        fprintf(stderr, "\n");
+        stats_phase(run_stats, PHASE_OUTPUT);
 
-        int* distance_matrix = malloc(num_structures * num_structures * sizeof(int));
-        if (!distance_matrix) {
-            fprintf(stderr, "Memory allocation failed for distance matrix\n");
+        // Symmetric adjacency between representatives (CSR), so that the
+        // edges of duplicates can be expanded in output order
+        int* adj_start = calloc(num_structures + 1, sizeof(int));
+        if (!adj_start) {
+            fprintf(stderr, "Memory allocation failed for neighbour lists\n");
+            return 1;
+        }
+        long long num_edges = 0;
+        for (int i = 0; i < num_structures; i++) {
+            for (int k = 0; k < row_count[i]; k++) {
+                adj_start[i + 1]++;
+                adj_start[row_neighbors[i][k] + 1]++;
+            }
+            num_edges += row_count[i];
+        }
+        for (int i = 0; i < num_structures; i++) {
+            adj_start[i + 1] += adj_start[i];
+        }
+        int* adj = malloc((2 * num_edges + 1) * sizeof(int));
+        int* adj_dist = malloc((2 * num_edges + 1) * sizeof(int));
+        int* adj_fill = malloc(num_structures * sizeof(int));
+        // Members of each representative, in input order
+        int* member_start = calloc(num_structures + 1, sizeof(int));
+        int* members = malloc(num_structures * sizeof(int));
+        int* member_fill = malloc(num_structures * sizeof(int));
+        Neighbor* line = malloc(num_structures * sizeof(Neighbor));
+        if (!adj || !adj_dist || !adj_fill || !member_start || !members || !member_fill || !line) {
+            fprintf(stderr, "Memory allocation failed for neighbour lists\n");
             return 1;
         }
+        memcpy(adj_fill, adj_start, num_structures * sizeof(int));
+        for (int i = 0; i < num_structures; i++) {
+            for (int k = 0; k < row_count[i]; k++) {
+                int j = row_neighbors[i][k];
+                adj[adj_fill[i]] = j;
+                adj_dist[adj_fill[i]++] = row_distances[i][k];
+                adj[adj_fill[j]] = i;
+                adj_dist[adj_fill[j]++] = row_distances[i][k];
+            }
+            free(row_neighbors[i]);
+            free(row_distances[i]);
+        }
+        for (int i = 0; i < num_structures; i++) {
+            member_start[rep[i] + 1]++;
+        }
+        for (int i = 0; i < num_structures; i++) {
+            member_start[i + 1] += member_start[i];
+        }
+        memcpy(member_fill, member_start, num_structures * sizeof(int));
         for (int i = 0; i < num_structures; i++) {
-            distance_matrix[i * num_structures + i] = 0;
+            members[member_fill[rep[i]]++] = i;
         }
 
-        #pragma omp parallel for schedule(dynamic)
+        // One "i j d" line per pair i < j, ordered by i and then j
+        long long reported = 0;
         for (int i = 0; i < num_structures; i++) {
-            for (int j = i + 1; j < num_structures; j++) {
-                int ted = tree_edit_dist(ti_array[i], ti_array[j]);
-                distance_matrix[i * num_structures + j] = ted;
-                distance_matrix[j * num_structures + i] = ted;
+            int a = rep[i];
+            int count = 0;
+            for (int m = member_start[a]; m < member_start[a + 1]; m++) {
+                if (members[m] > i) {
+                    line[count].index = members[m];
+                    line[count++].distance = 0;
+                }
             }
-            __atomic_fetch_add(&completed_rows, 1, __ATOMIC_SEQ_CST);
-            int percentage = (completed_rows * 100) / num_structures;
-            #pragma omp critical
-            {
-                if (percentage > last_percentage) {
-                    fprintf(stderr, "\rProgress: %d%%", percentage);
-                    fflush(stderr);
-                    last_percentage = percentage;
+            for (int k = adj_start[a]; k < adj_start[a + 1]; k++) {
+                int b = adj[k];
+                for (int m = member_start[b]; m < member_start[b + 1]; m++) {
+                    if (members[m] > i) {
+                        line[count].index = members[m];
+                        line[count++].distance = adj_dist[k];
+                    }
+                }
+            }
+            qsort(line, count, sizeof(Neighbor), compare_neighbor_index);
+            for (int k = 0; k < count; k++) {
+                write_edge(writer, i, line[k].index, line[k].distance);
+            }
+            reported += count;
+        }
+        writer_flush(writer);
+        fprintf(stderr, "%lld pairs within distance %d; %lld pairs pruned by lower bound, %lld computed\n",
+                reported, max_dist, pruned_pairs, computed_pairs);
+
+        free(adj_start);
+        free(adj);
+        free(adj_dist);
+        free(adj_fill);
+        free(member_start);
+        free(members);
+        free(member_fill);
+        free(line);
+        free(row_neighbors);
+        free(row_distances);
+        free(row_count);
+    } else if (knn > 0) {
+        // k-nearest-neighbour graph: each representative keeps a bounded
+        // heap of its knn + 1 best (distance, index) entries over all input
+        // structures, including its own duplicates at distance 0. Candidates
+        // are visited in lower-bound order, so the scan stops as soon as the
+        // bound exceeds the current worst entry, and every DP is capped there
+        int heap_capacity = knn + 1;
+        Neighbor* nearest = malloc((size_t)num_structures * heap_capacity * sizeof(Neighbor));
+        int* nearest_count = calloc(num_structures, sizeof(int));
+        int* member_start = calloc(num_structures + 1, sizeof(int));
+        int* members = malloc(num_structures * sizeof(int));
+        int* member_fill = malloc(num_structures * sizeof(int));
+        int* order = malloc(num_structures * sizeof(int));
+        if (!nearest || !nearest_count || !member_start || !members || !member_fill || !order) {
+            fprintf(stderr, "Memory allocation failed for neighbour lists\n");
+            return 1;
+        }
+        for (int i = 0; i < num_structures; i++) {
+            member_start[rep[i] + 1]++;
+        }
+        for (int i = 0; i < num_structures; i++) {
+            member_start[i + 1] += member_start[i];
+        }
+        memcpy(member_fill, member_start, num_structures * sizeof(int));
+        for (int i = 0; i < num_structures; i++) {
+            members[member_fill[rep[i]]++] = i;
+        }
+        LabelBucket* buckets;
+        int num_buckets = group_by_label_counts(ti_array, rep, num_structures, order, &buckets);
+
+        long long pruned_pairs = 0;
+        long long computed_pairs = 0;
+        _Atomic int completed_rows = 0;
+        Progress progress = start_progress();
+
+        #pragma omp parallel reduction(+:pruned_pairs, computed_pairs)
+        {
+            Workspace* ws = create_thread_workspace(max_nodes);
+            Neighbor* bucket_order = malloc(num_buckets * sizeof(Neighbor));
+            if (!bucket_order) {
+                fprintf(stderr, "Memory allocation failed for neighbour lists\n");
+                exit(1);
+            }
+            #pragma omp for schedule(dynamic)
+            for (int a = 0; a < num_structures; a++) {
+                if (rep[a] == a) {
+                    Neighbor* heap = nearest + (size_t)a * heap_capacity;
+                    int size = 0;
+                    for (int m = member_start[a]; m < member_start[a + 1]; m++) {
+                        heap_offer(heap, &size, heap_capacity, members[m], 0);
+                    }
+                    TreeInfo* ta = ti_array[a];
+                    for (int k = 0; k < num_buckets; k++) {
+                        bucket_order[k].index = k;
+                        bucket_order[k].distance = label_count_bound(ta->num_pairs, ta->num_unpaired,
+                                                                     buckets[k].num_pairs, buckets[k].num_unpaired);
+                    }
+                    qsort(bucket_order, num_buckets, sizeof(Neighbor), compare_neighbor_rank);
+                    int k = 0;
+                    for (; k < num_buckets; k++) {
+                        if (size == heap_capacity && bucket_order[k].distance > heap[0].distance) break;
+                        LabelBucket* bucket = &buckets[bucket_order[k].index];
+                        for (int p = bucket->start; p < bucket->end; p++) {
+                            int b = order[p];
+                            if (b == a) continue;
+                            int bound = size == heap_capacity ? heap[0].distance : NO_BOUND;
+                            if (bucket_order[k].distance > bound) {
+                                pruned_pairs++;
+                                continue;
+                            }
+                            computed_pairs++;
+                            int ted = tree_edit_dist_bounded(ta, ti_array[b], bound, ws);
+                            if (ted > bound) continue;
+                            for (int m = member_start[b]; m < member_start[b + 1]; m++) {
+                                heap_offer(heap, &size, heap_capacity, members[m], ted);
+                            }
+                        }
+                    }
+                    for (; k < num_buckets; k++) {
+                        LabelBucket* bucket = &buckets[bucket_order[k].index];
+                        pruned_pairs += bucket->end - bucket->start;
+                    }
+                    nearest_count[a] = size;
+                }
+                __atomic_fetch_add(&completed_rows, 1, __ATOMIC_SEQ_CST);
+                int percentage = (completed_rows * 100) / num_structures;
+                report_progress(&progress, percentage);
+            }
+            free(bucket_order);
+            free_workspace(ws);
+        }
+        fprintf(stderr, "\n");
+        stats_phase(run_stats, PHASE_OUTPUT);
+
+        // One "i j d" line per neighbour, ordered by distance and then index.
+        // Structure i drops itself from its representative's list
+        Neighbor* line = malloc(heap_capacity * sizeof(Neighbor));
+        if (!line) {
+            fprintf(stderr, "Memory allocation failed for neighbour lists\n");
+            return 1;
+        }
+        for (int i = 0; i < num_structures; i++) {
+            int a = rep[i];
+            int count = 0;
+            for (int k = 0; k < nearest_count[a]; k++) {
+                Neighbor* candidate = &nearest[(size_t)a * heap_capacity + k];
+                if (candidate->index != i) line[count++] = *candidate;
+            }
+            qsort(line, count, sizeof(Neighbor), compare_neighbor_rank);
+            if (count > knn) count = knn;
+            for (int k = 0; k < count; k++) {
+                write_edge(writer, i, line[k].index, line[k].distance);
+            }
+        }
+        writer_flush(writer);
+        fprintf(stderr, "%d nearest neighbours per structure; %lld pairs pruned by lower bound, %lld computed\n",
+                knn, pruned_pairs, computed_pairs);
+
+        free(nearest);
+        free(nearest_count);
+        free(member_start);
+        free(members);
+        free(member_fill);
+        free(order);
+        free(buckets);
+        free(line);
+    } else if (query_path) {
+        // Query-vs-reference: an m x n matrix with one row per query and one
+        // column per reference structure. Queries are processed in blocks of
+        // block_rows; within a block the flattened grid of (query,
+        // reference) pairs is shared between threads, so load balancing does
+        // not depend on the number of queries
+        int num_queries, num_unique_queries, query_max_nodes;
+        int* query_rep;
+        TreeInfo** query_ti;
+        char** queries = read_query_set(query_path, algorithm, &num_queries, &num_unique_queries, &query_rep, &query_ti, &query_max_nodes);
+        if (query_max_nodes > max_nodes) max_nodes = query_max_nodes;
+        stats_phase(run_stats, PHASE_DISTANCE);
+
+        int* references = malloc(num_unique * sizeof(int));
+        int* block_queries = malloc(block_rows * sizeof(int));
+        int* block = malloc((size_t)block_rows * num_structures * sizeof(int));
+        // Queries whose duplicates appear in later blocks keep a copy of
+        // their finished row in a spill file
+        int* row_slot = malloc(num_queries * sizeof(int));
+        if (!references || !block_queries || !block || !row_slot) {
+            fprintf(stderr, "Memory allocation failed for query block buffers\n");
+            return 1;
+        }
+        int num_references = 0;
+        for (int j = 0; j < num_structures; j++) {
+            if (rep[j] == j) references[num_references++] = j;
+        }
+        int num_row_slots = 0;
+        for (int q = 0; q < num_queries; q++) {
+            row_slot[q] = -1;
+        }
+        for (int q = 0; q < num_queries; q++) {
+            if (query_rep[q] != q && query_rep[q] / block_rows != q / block_rows && row_slot[query_rep[q]] < 0) {
+                row_slot[query_rep[q]] = num_row_slots++;
+            }
+        }
+        FILE* row_spill = NULL;
+        if (num_row_slots > 0) {
+            row_spill = tmpfile();
+            if (!row_spill) {
+                fprintf(stderr, "Failed to create temporary file for query mode\n");
+                return 1;
+            }
+        }
+
+        int num_blocks = (num_queries + block_rows - 1) / block_rows;
+        Progress progress = start_progress();
+        int block_count = 0;
+        int intra = use_intra_pair((long long)num_unique_queries * num_references, max_nodes, num_threads);
+        Workspace** pool = intra ? create_thread_pool(max_nodes, num_threads) : NULL;
+
+        #pragma omp parallel if(!intra)
+        {
+            Workspace* ws = intra ? NULL : create_thread_workspace(max_nodes);
+            for (int c = 0; c < num_blocks; c++) {
+                int q0 = c * block_rows;
+                int q1 = min(q0 + block_rows, num_queries);
+
+                #pragma omp single
+                {
+                    block_count = 0;
+                    for (int q = q0; q < q1; q++) {
+                        if (query_rep[q] == q) block_queries[block_count++] = q;
+                    }
+                }
+
+                long long num_pairs = (long long)block_count * num_references;
+                #pragma omp for schedule(dynamic, 16)
+                for (long long p = 0; p < num_pairs; p++) {
+                    int q = block_queries[p / num_references];
+                    int j = references[p % num_references];
+                    block[(size_t)(q - q0) * num_structures + j] = pair_distance(query_ti[q], ti_array[j], ws, pool, num_threads);
+                }
+
+                #pragma omp single
+                {
+                    for (int q = q0; q < q1; q++) {
+                        if (query_rep[q] != q) continue;
+                        int* row = block + (size_t)(q - q0) * num_structures;
+                        for (int j = 0; j < num_structures; j++) {
+                            if (rep[j] != j) row[j] = row[rep[j]];
+                        }
+                        if (row_slot[q] >= 0) {
+                            if (fseeko(row_spill, (off_t)row_slot[q] * num_structures * sizeof(int), SEEK_SET) != 0 ||
+                                fwrite(row, sizeof(int), num_structures, row_spill) != (size_t)num_structures) {
+                                fprintf(stderr, "Failed to write query spill file\n");
+                                exit(1);
+                            }
+                        }
+                    }
+                    for (int q = q0; q < q1; q++) {
+                        if (query_rep[q] == q) continue;
+                        int* row = block + (size_t)(q - q0) * num_structures;
+                        if (query_rep[q] >= q0) {
+                            memcpy(row, block + (size_t)(query_rep[q] - q0) * num_structures, num_structures * sizeof(int));
+                        } else if (fseeko(row_spill, (off_t)row_slot[query_rep[q]] * num_structures * sizeof(int), SEEK_SET) != 0 ||
+                                   fread(row, sizeof(int), num_structures, row_spill) != (size_t)num_structures) {
+                            fprintf(stderr, "Failed to read query spill file\n");
+                            exit(1);
+                        }
+                    }
+                    double output_start = omp_get_wtime();
+                    for (int q = q0; q < q1; q++) {
+                        write_row(writer, block + (size_t)(q - q0) * num_structures, 0, num_structures, FORMAT_MATRIX, dtype_size);
+                    }
+                    writer_flush(writer);
+                    fflush(stdout);
+                    stats_output_time(run_stats, omp_get_wtime() - output_start);
+
+                    int percentage = (int)(((long long)q1 * 100) / num_queries);
+                    report_progress(&progress, percentage);
+                }
+            }
+            free_workspace(ws);
+        }
+        fprintf(stderr, "\n");
+
+        free_workspace_pool(pool, num_threads);
+        if (row_spill) fclose(row_spill);
+        for (int q = 0; q < num_queries; q++) {
+            if (query_rep[q] == q) free_tree_info(query_ti[q]);
+        }
+        free_structures(queries, num_queries);
+        free(query_ti);
+        free(query_rep);
+        free(references);
+        free(block_queries);
+        free(block);
+        free(row_slot);
+    } else if (first_only) {
+        // Compute distances only for the first structure against all others
+        if (num_structures < 2) {
+            fprintf(stderr, "At least two structures are required for comparison.\n");
+            free_input_set(structures, ti_array, rep, num_structures, index);
+            return 1;
+        }
+
+        int* distances = malloc((num_structures - 1) * sizeof(int));
+        if (!distances) {
+            fprintf(stderr, "Memory allocation failed for distances array\n");
+            free_input_set(structures, ti_array, rep, num_structures, index);
+            return 1;
+        }
+
+        // With only a few large pairs, each pair is split over the threads
+        // instead and the loop itself runs on one thread
+        int intra = use_intra_pair(num_unique - 1, max_nodes, num_threads);
+        Workspace** pool = intra ? create_thread_pool(max_nodes, num_threads) : NULL;
+        #pragma omp parallel if(!intra)
+        {
+            Workspace* ws = intra ? NULL : create_thread_workspace(max_nodes);
+            #pragma omp for schedule(dynamic)
+            for (int j = 1; j < num_structures; j++) {
+                if (rep[j] != j || rep[j] == rep[0]) continue;
+                int ted = pair_distance(ti_array[0], ti_array[j], ws, pool, num_threads);
+                distances[j - 1] = ted;
+            }
+            free_workspace(ws);
+        }
+        free_workspace_pool(pool, num_threads);
+        for (int j = 1; j < num_structures; j++) {
+            if (rep[j] == rep[0]) {
+                distances[j - 1] = 0;
+            } else if (rep[j] != j) {
+                distances[j - 1] = distances[rep[j] - 1];
+            }
+        }
+
+        // Output distances one below the other
+        stats_phase(run_stats, PHASE_OUTPUT);
+        for (int j = 0; j < num_structures - 1; j++) {
+            writer_put_int(writer, distances[j]);
+            writer_put_char(writer, '\n');
+        }
+        writer_flush(writer);
+
+        free(distances);
+    } else if (row_wise) {
+        // Row-wise streaming: rows are processed in blocks and only the upper
+        // triangle (j > i) is computed. The part of a block that later rows
+        // need as their lower triangle is spilled to a temporary file in
+        // column-major order, so memory stays at block_rows x n
+        int num_blocks = (num_structures + block_rows - 1) / block_rows;
+        Progress progress = start_progress();
+
+        if (format == FORMAT_BINARY) {
+            write_binary_header(writer->out, num_structures, dtype_size, input_hash);
+        }
+
+        int* block = malloc((size_t)block_rows * num_structures * sizeof(int));
+        int* tile = malloc((size_t)block_rows * block_rows * sizeof(int));
+        off_t* spill_offset = malloc(num_blocks * sizeof(off_t));
+        FILE* spill = tmpfile();
+        if (!block || !tile || !spill_offset) {
+            fprintf(stderr, "Memory allocation failed for row-wise block buffers\n");
+            return 1;
+        }
+        if (!spill) {
+            fprintf(stderr, "Failed to create temporary file for row-wise mode\n");
+            return 1;
+        }
+        off_t spill_end = 0;
+
+        // Representatives whose duplicates appear in later blocks keep a copy
+        // of their finished row in a second spill file
+        int* row_slot = malloc(num_structures * sizeof(int));
+        FILE* row_spill = NULL;
+        if (!row_slot) {
+            fprintf(stderr, "Memory allocation failed for row-wise block buffers\n");
+            return 1;
+        }
+        int num_row_slots = 0;
+        for (int i = 0; i < num_structures; i++) {
+            row_slot[i] = -1;
+        }
+        for (int i = 0; i < num_structures; i++) {
+            if (rep[i] != i && rep[i] / block_rows != i / block_rows && row_slot[rep[i]] < 0) {
+                row_slot[rep[i]] = num_row_slots++;
+            }
+        }
+        if (num_row_slots > 0) {
+            row_spill = tmpfile();
+            if (!row_spill) {
+                fprintf(stderr, "Failed to create temporary file for row-wise mode\n");
+                return 1;
+            }
+        }
+
+        #pragma omp parallel
+        {
+            Workspace* ws = create_thread_workspace(max_nodes);
+            for (int c = 0; c < num_blocks; c++) {
+                int r0 = c * block_rows;
+                int r1 = min(r0 + block_rows, num_structures);
+
+                #pragma omp for schedule(dynamic)
+                for (int j = r0 + 1; j < num_structures; j++) {
+                    if (rep[j] != j) continue;
+                    int i_end = min(j, r1);
+                    for (int i = r0; i < i_end; i++) {
+                        if (rep[i] != i) continue;
+                        block[(size_t)(i - r0) * num_structures + j] = tree_edit_dist(ti_array[i], ti_array[j], ws);
+                    }
+                }
+
+                #pragma omp single
+                {
+                    // Lower triangle left of the block: read back the tiles
+                    // earlier blocks spilled for these columns
+                    int rows = r1 - r0;
+                    for (int b = 0; b < c; b++) {
+                        int b0 = b * block_rows;
+                        int b_rows = block_rows;
+                        int b1 = b0 + b_rows;
+                        size_t count = (size_t)b_rows * rows;
+                        if (fseeko(spill, spill_offset[b] + (off_t)(r0 - b1) * b_rows * sizeof(int), SEEK_SET) != 0 ||
+                            fread(tile, sizeof(int), count, spill) != count) {
+                            fprintf(stderr, "Failed to read row-wise spill file\n");
+                            exit(1);
+                        }
+                        for (int i = r0; i < r1; i++) {
+                            int* row = block + (size_t)(i - r0) * num_structures;
+                            memcpy(row + b0, tile + (size_t)(i - r0) * b_rows, b_rows * sizeof(int));
+                        }
+                    }
+                    // Lower triangle inside the block, mirrored from the rows above
+                    for (int i = r0; i < r1; i++) {
+                        int* row = block + (size_t)(i - r0) * num_structures;
+                        row[i] = 0; // Distance to itself is 0
+                        for (int x = r0; x < i; x++) {
+                            row[x] = block[(size_t)(x - r0) * num_structures + i];
+                        }
+                    }
+                    if (num_unique < num_structures) {
+                        // So far only cells between representatives are valid:
+                        // duplicate columns repeat their representative's
+                        // column, and duplicate rows repeat its whole row,
+                        // taken from this block or from the row spill file
+                        for (int i = r0; i < r1; i++) {
+                            if (rep[i] != i) continue;
+                            int* row = block + (size_t)(i - r0) * num_structures;
+                            for (int j = 0; j < num_structures; j++) {
+                                if (rep[j] != j) row[j] = rep[j] == i ? 0 : row[rep[j]];
+                            }
+                            if (row_slot[i] >= 0) {
+                                if (fseeko(row_spill, (off_t)row_slot[i] * num_structures * sizeof(int), SEEK_SET) != 0 ||
+                                    fwrite(row, sizeof(int), num_structures, row_spill) != (size_t)num_structures) {
+                                    fprintf(stderr, "Failed to write row-wise spill file\n");
+                                    exit(1);
+                                }
+                            }
+                        }
+                        for (int i = r0; i < r1; i++) {
+                            if (rep[i] == i) continue;
+                            int* row = block + (size_t)(i - r0) * num_structures;
+                            if (rep[i] >= r0) {
+                                memcpy(row, block + (size_t)(rep[i] - r0) * num_structures, num_structures * sizeof(int));
+                            } else if (fseeko(row_spill, (off_t)row_slot[rep[i]] * num_structures * sizeof(int), SEEK_SET) != 0 ||
+                                       fread(row, sizeof(int), num_structures, row_spill) != (size_t)num_structures) {
+                                fprintf(stderr, "Failed to read row-wise spill file\n");
+                                exit(1);
+                            }
+                        }
+                    }
+
+                    double output_start = omp_get_wtime();
+                    for (int i = r0; i < r1; i++) {
+                        write_row(writer, block + (size_t)(i - r0) * num_structures, i, num_structures, format, dtype_size);
+                    }
+                    writer_flush(writer);
+                    fflush(stdout);
+                    stats_output_time(run_stats, omp_get_wtime() - output_start);
+
+                    // Spill the part right of the block, column by column, so
+                    // each later block finds its tile as one contiguous run
+                    spill_offset[c] = spill_end;
+                    if (fseeko(spill, spill_end, SEEK_SET) != 0) {
+                        fprintf(stderr, "Failed to seek in row-wise spill file\n");
+                        exit(1);
+                    }
+                    for (int j0 = r1; j0 < num_structures; j0 += block_rows) {
+                        int j1 = min(j0 + block_rows, num_structures);
+                        for (int j = j0; j < j1; j++) {
+                            for (int i = r0; i < r1; i++) {
+                                tile[(size_t)(j - j0) * rows + (i - r0)] = block[(size_t)(i - r0) * num_structures + j];
+                            }
+                        }
+                        size_t count = (size_t)(j1 - j0) * rows;
+                        if (fwrite(tile, sizeof(int), count, spill) != count) {
+                            fprintf(stderr, "Failed to write row-wise spill file\n");
+                            exit(1);
+                        }
+                        spill_end += count * sizeof(int);
+                    }
+
+                    int percentage = (int)(((long long)r1 * 100) / num_structures);
+                    report_progress(&progress, percentage);
+                }
+            }
+            free_workspace(ws);
+        }
+        fprintf(stderr, "\n");
+        fclose(spill);
+        if (row_spill) fclose(row_spill);
+        free(row_slot);
+        free(spill_offset);
+        free(tile);
+        free(block);
+    } else if (num_shards > 0) {
+        // One shard of a multi-process all-vs-all run: the tiles of the
+        // full-matrix plan assigned to this shard, written as they finish
+        int* reps = malloc(num_unique * sizeof(int));
+        if (!reps) {
+            fprintf(stderr, "Memory allocation failed for tile schedule\n");
+            return 1;
+        }
+        int num_reps = 0;
+        for (int i = 0; i < num_structures; i++) {
+            if (rep[i] == i) reps[num_reps++] = i;
+        }
+        int tile_size = (num_reps + MAX_TILE_BLOCKS - 1) / MAX_TILE_BLOCKS;
+        if (tile_size < DEFAULT_TILE_SIZE) tile_size = DEFAULT_TILE_SIZE;
+        int num_tiles;
+        Tile* tiles = plan_tiles(ti_array, reps, num_reps, tile_size, &num_tiles);
+        int* owner = assign_shards(tiles, num_tiles, num_shards);
+        Tile* schedule = malloc((num_tiles > 0 ? num_tiles : 1) * sizeof(Tile));
+        if (!schedule) {
+            fprintf(stderr, "Memory allocation failed for tile schedule\n");
+            return 1;
+        }
+        int shard_tiles = 0;
+        long long shard_pairs = 0;
+        for (int t = 0; t < num_tiles; t++) {
+            if (owner[t] != shard_index) continue;
+            schedule[shard_tiles++] = tiles[t];
+            shard_pairs += tiles[t].pairs;
+        }
+        qsort(schedule, shard_tiles, sizeof(Tile), compare_tile_cost);
+        fprintf(stderr, "Shard %d/%d: %d of %d tiles, %lld pairs\n", shard_index, num_shards, shard_tiles, num_tiles, shard_pairs);
+        write_shard_header(writer->out, num_structures, dtype_size, input_hash, shard_index, num_shards,
+                           tile_size, num_reps, num_tiles, shard_tiles, rep);
+
+        _Atomic long long completed_pairs = 0;
+        _Atomic int next_tile = 0;
+        Progress progress = start_progress();
+        #pragma omp parallel
+        {
+            Workspace* ws = create_thread_workspace(max_nodes);
+            int* values = malloc((size_t)tile_size * tile_size * sizeof(int));
+            if (!values) {
+                fprintf(stderr, "Memory allocation failed for tile buffer\n");
+                exit(1);
+            }
+            for (;;) {
+                int t = __atomic_fetch_add(&next_tile, 1, __ATOMIC_RELAXED);
+                if (t >= shard_tiles) break;
+                Tile* tile = &schedule[t];
+                int a0 = tile->row_block * tile_size;
+                int a1 = min(a0 + tile_size, num_reps);
+                int b0 = tile->col_block * tile_size;
+                int b1 = min(b0 + tile_size, num_reps);
+                int k = 0;
+                for (int a = a0; a < a1; a++) {
+                    for (int b = b0 > a + 1 ? b0 : a + 1; b < b1; b++) {
+                        values[k++] = tree_edit_dist(ti_array[reps[a]], ti_array[reps[b]], ws);
+                    }
+                }
+                long long done = __atomic_add_fetch(&completed_pairs, tile->pairs, __ATOMIC_SEQ_CST);
+                int percentage = shard_pairs > 0 ? (int)(done * 100 / shard_pairs) : 100;
+                #pragma omp critical
+                write_shard_tile(writer->out, tile, values, dtype_size);
+                report_progress(&progress, percentage);
+            }
+            free(values);
+            free_workspace(ws);
+        }
+        fprintf(stderr, "\n");
+        free(reps);
+        free(tiles);
+        free(owner);
+        free(schedule);
+    } else if (extend_path) {
+        // Appended structures: only cells with at least one new structure are
+        // computed. Pairs are grouped by row, so each task writes one
+        // contiguous run of the file
+        int num_old;
+        Triangle* distance_matrix = open_extended_triangle(extend_path, output_path, structures, num_structures, &num_old);
+        fprintf(stderr, "Extending a matrix of %d structures by %d\n", num_old, num_structures - num_old);
+        int* new_reps = malloc((num_structures - num_old + 1) * sizeof(int));
+        if (!new_reps) {
+            fprintf(stderr, "Memory allocation failed for new structures\n");
+            return 1;
+        }
+        int num_new_reps = 0;
+        for (int j = num_old; j < num_structures; j++) {
+            if (rep[j] == j) new_reps[num_new_reps++] = j;
+        }
+        long long total_pairs = 0;
+        int later_new_reps = num_new_reps;
+        for (int i = 0; i < num_structures; i++) {
+            if (rep[i] != i) continue;
+            if (i >= num_old) later_new_reps--;
+            total_pairs += later_new_reps;
+        }
+
+        _Atomic long long completed_pairs = 0;
+        Progress progress = start_progress();
+        int intra = use_intra_pair(total_pairs, max_nodes, num_threads);
+        Workspace** pool = intra ? create_thread_pool(max_nodes, num_threads) : NULL;
+        #pragma omp parallel if(!intra)
+        {
+            Workspace* ws = intra ? NULL : create_thread_workspace(max_nodes);
+            #pragma omp for schedule(dynamic)
+            for (int i = 0; i < num_structures; i++) {
+                if (rep[i] != i) continue;
+                long long row_pairs = 0;
+                for (int t = 0; t < num_new_reps; t++) {
+                    int j = new_reps[t];
+                    if (j <= i) continue;
+                    set_distance(distance_matrix, i, j, pair_distance(ti_array[i], ti_array[j], ws, pool, num_threads));
+                    row_pairs++;
                 }
+                if (row_pairs == 0) continue;
+                long long done = __atomic_add_fetch(&completed_pairs, row_pairs, __ATOMIC_SEQ_CST);
+                report_progress(&progress, (int)(done * 100 / total_pairs));
+            }
+            free_workspace(ws);
+        }
+        free_workspace_pool(pool, num_threads);
+        fprintf(stderr, "\n");
+
+        // New cells of duplicates, which may also repeat an old structure
+        stats_phase(run_stats, PHASE_OUTPUT);
+        #pragma omp parallel for schedule(dynamic)
+        for (int i = 0; i < num_structures; i++) {
+            for (int j = i + 1 > num_old ? i + 1 : num_old; j < num_structures; j++) {
+                if (rep[i] == i && rep[j] == j) continue;
+                set_distance(distance_matrix, i, j, rep[i] == rep[j] ? 0 : get_distance(distance_matrix, rep[i], rep[j]));
             }
         }
+        fill_binary_header(distance_matrix->map, num_structures, distance_matrix->dtype_size, input_hash);
+        free_triangle(distance_matrix);
+        free(new_reps);
+    } else {
+        // Full matrix computation over tiles of representative pairs
+        _Atomic long long completed_pairs = 0;
+        Progress progress = start_progress();
+
+        // Only the upper triangle is stored; text output mirrors it on the fly
+        Triangle* distance_matrix;
+        if (resume) {
+            distance_matrix = open_mapped_triangle(output_path, num_structures, dtype_size);
+        } else if (mapped_output) {
+            distance_matrix = create_mapped_triangle(output_path, num_structures, dtype_size);
+        } else {
+            distance_matrix = create_triangle(num_structures, format == FORMAT_BINARY ? dtype_size : 4);
+        }
 
-        // Output the full matrix
+        // Tiles keep the trees of a block hot in cache and are dispatched
+        // most expensive first from a shared cursor. The canonical tile
+        // order is kept for checkpointing, so sorting does not change the
+        // meaning of a unit
+        int* reps = malloc(num_unique * sizeof(int));
+        if (!reps) {
+            fprintf(stderr, "Memory allocation failed for tile schedule\n");
+            return 1;
+        }
+        int num_reps = 0;
         for (int i = 0; i < num_structures; i++) {
-            for (int j = 0; j < num_structures; j++) {
-                printf("%d ", distance_matrix[i * num_structures + j]);
+            if (rep[i] == i) reps[num_reps++] = i;
+        }
+        int tile_size = (num_reps + MAX_TILE_BLOCKS - 1) / MAX_TILE_BLOCKS;
+        if (tile_size < DEFAULT_TILE_SIZE) tile_size = DEFAULT_TILE_SIZE;
+        int num_tiles;
+        Tile* tiles = plan_tiles(ti_array, reps, num_reps, tile_size, &num_tiles);
+        Tile* schedule = malloc((num_tiles > 0 ? num_tiles : 1) * sizeof(Tile));
+        if (!schedule) {
+            fprintf(stderr, "Memory allocation failed for tile schedule\n");
+            return 1;
+        }
+        memcpy(schedule, tiles, num_tiles * sizeof(Tile));
+        qsort(schedule, num_tiles, sizeof(Tile), compare_tile_cost);
+        long long total_pairs = 0;
+        for (int t = 0; t < num_tiles; t++) {
+            total_pairs += tiles[t].pairs;
+        }
+
+        Checkpoint* checkpoint = NULL;
+        if (mapped_output && (checkpoint_interval > 0 || resume)) {
+            checkpoint = create_checkpoint(output_path, num_structures, dtype_size, input_hash, num_tiles, checkpoint_interval);
+            if (resume) {
+                int completed_tiles = load_checkpoint(checkpoint);
+                fprintf(stderr, "Resuming with %d of %d tiles already complete\n", completed_tiles, num_tiles);
+                for (int t = 0; t < num_tiles; t++) {
+                    if (checkpoint->done[t]) completed_pairs += tiles[t].pairs;
+                }
+            }
+        }
+
+        int intra = use_intra_pair(total_pairs, max_nodes, num_threads);
+        Workspace** pool = intra ? create_thread_pool(max_nodes, num_threads) : NULL;
+        _Atomic int next_tile = 0;
+        #pragma omp parallel if(!intra)
+        {
+            Workspace* ws = intra ? NULL : create_thread_workspace(max_nodes);
+            for (;;) {
+                int t = __atomic_fetch_add(&next_tile, 1, __ATOMIC_RELAXED);
+                if (t >= num_tiles) break;
+                Tile* tile = &schedule[t];
+                if (checkpoint && checkpoint->done[tile->id]) continue;
+                int a0 = tile->row_block * tile_size;
+                int a1 = min(a0 + tile_size, num_reps);
+                int b0 = tile->col_block * tile_size;
+                int b1 = min(b0 + tile_size, num_reps);
+                for (int a = a0; a < a1; a++) {
+                    int i = reps[a];
+                    for (int b = b0 > a + 1 ? b0 : a + 1; b < b1; b++) {
+                        int j = reps[b];
+                        int ted = pair_distance(ti_array[i], ti_array[j], ws, pool, num_threads);
+                        set_distance(distance_matrix, i, j, ted);
+                    }
+                }
+                if (checkpoint) mark_unit_done(checkpoint, distance_matrix, tile->id);
+                long long done = __atomic_add_fetch(&completed_pairs, tile->pairs, __ATOMIC_SEQ_CST);
+                int percentage = total_pairs > 0 ? (int)(done * 100 / total_pairs) : 100;
+                report_progress(&progress, percentage);
             }
-            printf("\n");
+            free_workspace(ws);
+        }
+        free_workspace_pool(pool, num_threads);
+        free(reps);
+        free(tiles);
+        free(schedule);
+
+        stats_phase(run_stats, PHASE_OUTPUT);
+        if (num_unique < num_structures) {
+            fill_duplicate_cells(distance_matrix, rep);
+        }
+        if (mapped_output) {
+            fill_binary_header(distance_matrix->map, num_structures, dtype_size, input_hash);
+        } else {
+            write_triangle(writer, distance_matrix, format, input_hash);
         }
         fprintf(stderr, "\n");
-        free(distance_matrix);
+        free_triangle(distance_matrix);
+        if (checkpoint) {
+            // The output is complete and flushed, so the checkpoint is obsolete
+            remove(checkpoint->path);
+            free_checkpoint(checkpoint);
+        }
+    }
+
+    if (subtree_cache) {
+        report_subtree_cache(subtree_cache);
+        free_subtree_cache(subtree_cache);
     }
 
     // Clean up memory
-    for (int i = 0; i < num_structures; i++) {
-        free(structures[i]);
-        free_node(trees[i]);
-        free_tree_info(ti_array[i]);
+    free_input_set(structures, ti_array, rep, num_structures, index);
+    if (writer->out != stdout && fclose(writer->out) != 0) {
+        fprintf(stderr, "Failed to write output file %s\n", output_path);
+        return 1;
     }
-    free(structures);
-    free(trees);
-    free(ti_array);
+    free(writer);
+    finish_run_stats(run_stats);
 
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,876 @@
+// Tree edit distance engine: dot-bracket parsing, tree preprocessing and
+// the Zhang-Shasha distance computation, shared by the library API
+// (rnated.h) and the RNAtedistance command line tool
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <omp.h>
+#include "rnated.h"
+#include "rnated_internal.h"
+
+#define INTRA_PAIR_MIN_NODES 500 // Smallest trees worth splitting a single pair over threads
+#define HASH_MOD ((1ULL << 61) - 1)
+#define HASH_BASE 1000003ULL
+#define CACHE_BYTES_PER_SLOT 512 // Expected entry size, sets the slots per shard
+#define CACHE_MIN_CELLS 64       // Smaller keyroot pairs are cheaper to recompute
+
+// The forest-distance row kernel is compiled for several instruction sets
+// and picked at load time (GCC function multiversioning, needs ifunc)
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__) && defined(__linux__)
+#define KERNEL_CLONES __attribute__((target_clones("avx512f", "avx2", "sse4.1", "default")))
+#else
+#define KERNEL_CLONES
+#endif
+
+// Polynomial hashing modulo the Mersenne prime 2^61 - 1
+static inline uint64_t mod_mersenne61(__uint128_t x) {
+    uint64_t r = (uint64_t)(x & HASH_MOD) + (uint64_t)(x >> 61);
+    r = (r & HASH_MOD) + (r >> 61);
+    return r >= HASH_MOD ? r - HASH_MOD : r;
+}
+
+// Hash of every keyroot subtree: the postorder sequence of (label, subtree
+// size) determines an ordered labelled tree, and each subtree is a
+// contiguous range [leftmost[k], k] of it, so range hashes of one prefix
+// hash give canonical subtree hashes independent of position
+static int compute_keyroot_hashes(TreeInfo* ti) {
+    int n = ti->postorder_size;
+    uint64_t* prefix = malloc((n + 1) * sizeof(uint64_t));
+    uint64_t* power = malloc((n + 1) * sizeof(uint64_t));
+    if (!prefix || !power) {
+        free(prefix);
+        free(power);
+        return -1;
+    }
+    prefix[0] = 0;
+    power[0] = 1;
+    for (int k = 0; k < n; k++) {
+        uint64_t symbol = (uint64_t)(k - ti->leftmost[k] + 1) * 4 + (ti->labels[k] == 'P' ? 1 : ti->labels[k] == 'U' ? 2 : 3);
+        prefix[k + 1] = mod_mersenne61((__uint128_t)prefix[k] * HASH_BASE + symbol);
+        power[k + 1] = mod_mersenne61((__uint128_t)power[k] * HASH_BASE);
+    }
+    for (int ki = 0; ki < ti->num_keyroots; ki++) {
+        int k = ti->keyroots[ki];
+        int l = ti->leftmost[k];
+        uint64_t shifted = mod_mersenne61((__uint128_t)prefix[l] * power[k - l + 1]);
+        ti->keyroot_hash[ki] = prefix[k + 1] >= shifted ? prefix[k + 1] - shifted : prefix[k + 1] + HASH_MOD - shifted;
+    }
+    free(prefix);
+    free(power);
+    return 0;
+}
+
+// Cache of solved keyroot pairs shared by all threads. A keyroot pair
+// writes the subtree distances between the nodes on the two leftmost paths,
+// and those depend only on the two subtrees, so a pair of subtrees seen
+// before in any trees can copy them instead of running forest_dist. Each
+// shard is a direct-mapped table under its own lock, limited to a share of
+// the byte budget; a new entry replaces the one in its slot
+SubtreeCache* create_subtree_cache(size_t budget_bytes) {
+    SubtreeCache* cache = malloc(sizeof(SubtreeCache));
+    if (!cache) return NULL;
+    cache->shard_budget = budget_bytes / CACHE_SHARDS;
+    cache->slots_per_shard = (int)(cache->shard_budget / CACHE_BYTES_PER_SLOT);
+    if (cache->slots_per_shard < 1) cache->slots_per_shard = 1;
+    for (int s = 0; s < CACHE_SHARDS; s++) {
+        CacheShard* shard = &cache->shards[s];
+        shard->slots = calloc(cache->slots_per_shard, sizeof(CacheEntry*));
+        if (!shard->slots) {
+            while (--s >= 0) {
+                free(cache->shards[s].slots);
+                omp_destroy_lock(&cache->shards[s].lock);
+            }
+            free(cache);
+            return NULL;
+        }
+        omp_init_lock(&shard->lock);
+        shard->bytes = 0;
+        shard->hits = 0;
+        shard->misses = 0;
+    }
+    return cache;
+}
+
+void free_subtree_cache(SubtreeCache* cache) {
+    if (!cache) return;
+    for (int s = 0; s < CACHE_SHARDS; s++) {
+        CacheShard* shard = &cache->shards[s];
+        for (int k = 0; k < cache->slots_per_shard; k++) {
+            free(shard->slots[k]);
+        }
+        free(shard->slots);
+        omp_destroy_lock(&shard->lock);
+    }
+    free(cache);
+}
+
+static inline uint64_t cache_key_mix(uint64_t hash1, uint64_t hash2) {
+    uint64_t x = hash1 * 0x9E3779B97F4A7C15ULL ^ hash2;
+    x ^= x >> 29;
+    x *= 0xBF58476D1CE4E5B9ULL;
+    return x ^ (x >> 32);
+}
+
+// Copies a cached block into treedist at the given path nodes; returns 0 on
+// a miss
+static int cache_lookup(SubtreeCache* cache, uint64_t hash1, uint64_t hash2, const int32_t* path1, int len1,
+                        const int32_t* path2, int len2, int* treedist, int n) {
+    uint64_t mix = cache_key_mix(hash1, hash2);
+    CacheShard* shard = &cache->shards[mix % CACHE_SHARDS];
+    int found = 0;
+    omp_set_lock(&shard->lock);
+    CacheEntry* entry = shard->slots[(mix / CACHE_SHARDS) % cache->slots_per_shard];
+    if (entry && entry->hash1 == hash1 && entry->hash2 == hash2 && entry->len1 == len1 && entry->len2 == len2) {
+        for (int a = 0; a < len1; a++) {
+            int* td_row = treedist + (size_t)path1[a] * n;
+            for (int b = 0; b < len2; b++) {
+                td_row[path2[b]] = entry->values[a * len2 + b];
+            }
+        }
+        shard->hits++;
+        found = 1;
+    } else {
+        shard->misses++;
+    }
+    omp_unset_lock(&shard->lock);
+    return found;
+}
+
+static void cache_store(SubtreeCache* cache, uint64_t hash1, uint64_t hash2, const int32_t* path1, int len1,
+                        const int32_t* path2, int len2, const int* treedist, int n) {
+    size_t bytes = sizeof(CacheEntry) + (size_t)len1 * len2 * sizeof(int);
+    if (bytes > cache->shard_budget) return;
+    CacheEntry* entry = malloc(bytes);
+    if (!entry) return;
+    entry->hash1 = hash1;
+    entry->hash2 = hash2;
+    entry->len1 = len1;
+    entry->len2 = len2;
+    entry->bytes = bytes;
+    for (int a = 0; a < len1; a++) {
+        const int* td_row = treedist + (size_t)path1[a] * n;
+        for (int b = 0; b < len2; b++) {
+            entry->values[a * len2 + b] = td_row[path2[b]];
+        }
+    }
+    uint64_t mix = cache_key_mix(hash1, hash2);
+    CacheShard* shard = &cache->shards[mix % CACHE_SHARDS];
+    omp_set_lock(&shard->lock);
+    CacheEntry** slot = &shard->slots[(mix / CACHE_SHARDS) % cache->slots_per_shard];
+    size_t freed = *slot ? (*slot)->bytes : 0;
+    if (shard->bytes - freed + bytes <= cache->shard_budget) {
+        free(*slot);
+        *slot = entry;
+        shard->bytes += bytes - freed;
+        entry = NULL;
+    }
+    omp_unset_lock(&shard->lock);
+    free(entry);
+}
+
+// db must have passed validate_structure
+static TreeInfo* compute_tree_info(const char* db, int len) {
+    // Every '.' and every base pair becomes one node, plus the root
+    int num_nodes = len + 1;
+    for (int i = 0; i < len; i++) {
+        if (db[i] == ')') num_nodes--;
+    }
+    if (num_nodes < 1) num_nodes = 1;
+
+    // Struct and all per-node arrays share a single allocation
+    TreeInfo* ti = malloc(sizeof(TreeInfo) + (size_t)num_nodes * (sizeof(uint64_t) + 2 * sizeof(int32_t) + sizeof(uint8_t)));
+    if (!ti) return NULL;
+    ti->keyroot_hash = (uint64_t*)(ti + 1);
+    ti->leftmost = (int32_t*)(ti->keyroot_hash + num_nodes);
+    ti->keyroots = ti->leftmost + num_nodes;
+    ti->labels = (uint8_t*)(ti->keyroots + num_nodes);
+
+    // One frame per open pair plus one for the root: the postorder index the
+    // pair's subtree starts at, whether the pair is its parent's first child,
+    // and whether the frame has received a child yet
+    int* frame_leftmost = malloc(sizeof(int) * (len + 1));
+    char* frame_first = malloc(len + 1);
+    char* frame_has_child = malloc(len + 1);
+    if (!frame_leftmost || !frame_first || !frame_has_child) {
+        free(frame_leftmost);
+        free(frame_first);
+        free(frame_has_child);
+        free(ti);
+        return NULL;
+    }
+    int depth = 0;
+    frame_has_child[0] = 0;
+
+    int index = 0;
+    int kr_index = 0;
+    ti->num_pairs = 0;
+    ti->num_unpaired = 0;
+    for (int i = 0; i < len; i++) {
+        char c = db[i];
+        if (c == '.') {
+            int is_first = !frame_has_child[depth];
+            frame_has_child[depth] = 1;
+            ti->labels[index] = 'U';
+            ti->leftmost[index] = index;
+            ti->num_unpaired++;
+            if (!is_first) ti->keyroots[kr_index++] = index;
+            index++;
+        } else if (c == '(') {
+            int is_first = !frame_has_child[depth];
+            frame_has_child[depth] = 1;
+            depth++;
+            frame_leftmost[depth] = index;
+            frame_first[depth] = is_first;
+            frame_has_child[depth] = 0;
+        } else {
+            // A pair is emitted once its subtree is complete, which is postorder
+            ti->labels[index] = 'P';
+            ti->leftmost[index] = frame_leftmost[depth];
+            ti->num_pairs++;
+            if (!frame_first[depth]) ti->keyroots[kr_index++] = index;
+            index++;
+            depth--;
+        }
+    }
+    ti->labels[index] = 'R';
+    ti->leftmost[index] = 0;
+    ti->keyroots[kr_index++] = index;
+    index++;
+
+    ti->postorder_size = index;
+    ti->num_keyroots = kr_index;
+    ti->keyroot_cost = 0;
+    for (int k = 0; k < kr_index; k++) {
+        ti->keyroot_cost += ti->keyroots[k] - ti->leftmost[ti->keyroots[k]] + 1;
+    }
+    ti->mirror = NULL;
+    ti->mirrored = 0;
+    free(frame_leftmost);
+    free(frame_first);
+    free(frame_has_child);
+    if (compute_keyroot_hashes(ti) != 0) {
+        free(ti);
+        return NULL;
+    }
+    return ti;
+}
+
+// Tree of the mirrored structure (reversed, brackets swapped). Its
+// left-path decomposition is the right-path decomposition of the original,
+// and mirroring both trees of a pair leaves their edit distance unchanged
+static TreeInfo* compute_mirrored_tree_info(const char* db, int len) {
+    char* mirrored = malloc(len + 1);
+    if (!mirrored) return NULL;
+    for (int i = 0; i < len; i++) {
+        char c = db[len - 1 - i];
+        mirrored[i] = c == '(' ? ')' : c == ')' ? '(' : c;
+    }
+    mirrored[len] = 0;
+    TreeInfo* ti = compute_tree_info(mirrored, len);
+    free(mirrored);
+    if (ti) ti->mirrored = 1;
+    return ti;
+}
+
+void free_tree_info(TreeInfo* ti) {
+    if (ti->mirror) free(ti->mirror);
+    free(ti);
+}
+
+static inline int cost_insert(char label) {
+    return (label == 'P') ? 2 : 1;
+}
+
+static inline int cost_delete(char label) {
+    return (label == 'P') ? 2 : 1;
+}
+
+Workspace* create_workspace(int max_nodes, SubtreeCache* cache) {
+    Workspace* ws = malloc(sizeof(Workspace));
+    if (!ws) return NULL;
+    ws->treedist = NULL;
+    ws->max_nodes = 0;
+    ws->cache = cache;
+    memset(&ws->own_counters, 0, sizeof(WorkCounters));
+    ws->counters = &ws->own_counters;
+    if (reserve_workspace(ws, max_nodes) != 0) {
+        free(ws);
+        return NULL;
+    }
+    return ws;
+}
+
+// Grows the buffers to hold trees of up to max_nodes nodes; returns -1 if
+// the allocation fails, leaving the workspace unchanged
+int reserve_workspace(Workspace* ws, int max_nodes) {
+    if (max_nodes <= ws->max_nodes && ws->treedist) return 0;
+    // One contiguous block: treedist needs max_nodes^2 cells, fd (max_nodes + 1)^2
+    size_t td_cells = (size_t)max_nodes * max_nodes;
+    size_t fd_cells = (size_t)(max_nodes + 1) * (max_nodes + 1);
+    // Zeroed, since vectorised rows also read (and discard) cells that were
+    // never written
+    int* buffer = calloc(td_cells + fd_cells + 2 * (size_t)max_nodes, sizeof(int));
+    if (!buffer) return -1;
+    free(ws->treedist);
+    ws->treedist = buffer;
+    ws->fd = ws->treedist + td_cells;
+    ws->path1 = ws->fd + fd_cells;
+    ws->path2 = ws->path1 + max_nodes;
+    ws->max_nodes = max_nodes;
+    return 0;
+}
+
+void free_workspace(Workspace* ws) {
+    if (!ws) return;
+    free(ws->treedist);
+    free(ws);
+}
+
+// Terms of one forest-distance row that only depend on earlier rows: delete
+// from the row above, and either relabel (both nodes on the leftmost paths
+// of their keyroots) or matching whole subtrees through the earlier row
+// sub_row. The loop is branch-free so it vectorises, with the subtree term
+// as a gather through leftmost; the insert term is left to a scan.
+// Out-of-band subtree terms in bounded mode read stale cells, which the
+// select then discards
+KERNEL_CLONES
+static void forest_row_terms(int* restrict row, const int* prev, const int* sub_row, const int* td_row,
+                             const int32_t* leftmost2, const uint8_t* labels2, int l2, int lo, int hi,
+                             int idx1, int size1, int r, int path_row, uint8_t label1, int bound) {
+    int delete_cost = label1 == 'P' ? 2 : 1;
+    int cap = bound + 1;
+    if (bound >= NO_BOUND) {
+        for (int dj = lo; dj <= hi; dj++) {
+            int idx2 = l2 + dj - 1;
+            int lm2 = leftmost2[idx2];
+            int relabel_cost = prev[dj - 1] + (labels2[idx2] != label1);
+            int subtree_cost = sub_row[lm2 - l2] + td_row[idx2];
+            int term = (path_row & (lm2 == l2)) ? relabel_cost : subtree_cost;
+            int cost = prev[dj] + delete_cost;
+            row[dj] = cost < term ? cost : term;
+        }
+        return;
+    }
+    for (int dj = lo; dj <= hi; dj++) {
+        int idx2 = l2 + dj - 1;
+        int lm2 = leftmost2[idx2];
+        int c = lm2 - l2;
+        int relabel_cost = prev[dj - 1] + (labels2[idx2] != label1);
+        int subtree_cost = sub_row[c] + td_row[idx2];
+        // Matching idx1 with idx2 needs their subtree distance, which is
+        // only valid if it could be <= bound: postorder positions and
+        // subtree sizes may differ by at most bound
+        int valid = (abs(idx1 - idx2) <= bound) & (abs(size1 - (idx2 - lm2)) <= bound) & (abs(r - c) <= bound);
+        int term = (path_row & (lm2 == l2)) ? relabel_cost : (valid ? subtree_cost : cap);
+        int cost = prev[dj] + delete_cost;
+        cost = cost < term ? cost : term;
+        row[dj] = cost < cap ? cost : cap;
+    }
+}
+
+// Computes forest distances for keyroot pair (i, j). All values saturate at
+// bound + 1: cells whose prefix forests differ in size by more than bound
+// are skipped, and subtree pairs that cannot occur in a mapping of cost
+// <= bound are never matched. Values <= bound are therefore exact, and
+// larger ones only mean "more than bound"
+static void forest_dist(int i, int j, const TreeInfo* t1, const TreeInfo* t2, int* treedist, int* fd, int bound) {
+    int l1 = t1->leftmost[i];
+    int l2 = t2->leftmost[j];
+    int base_d1 = i - l1 + 2;
+    int base_d2 = j - l2 + 2;
+    int n = t2->postorder_size;
+    int cap = bound + 1;
+    // fd is a flat base_d1 x base_d2 table; cells outside the band are never
+    // written, so reads of them are guarded by the band condition
+    fd[0] = 0;
+    for (int di = 1; di < base_d1; di++) {
+        int idx1 = l1 + di - 1;
+        char label1 = t1->labels[idx1];
+        fd[di * base_d2] = min(fd[(di - 1) * base_d2] + cost_delete(label1), cap);
+    }
+    for (int dj = 1; dj < base_d2; dj++) {
+        int idx2 = l2 + dj - 1;
+        char label2 = t2->labels[idx2];
+        fd[dj] = min(fd[dj - 1] + cost_insert(label2), cap);
+    }
+    for (int di = 1; di < base_d1; di++) {
+        int idx1 = l1 + di - 1;
+        uint8_t label1 = t1->labels[idx1];
+        int lm1 = t1->leftmost[idx1];
+        int r = lm1 - l1;
+        int* row = fd + di * base_d2;
+        int* td_row = treedist + idx1 * n;
+        int lo = di - bound > 1 ? di - bound : 1;
+        int hi = di + bound < base_d2 - 1 ? di + bound : base_d2 - 1;
+        // Border cells keep the neighbouring rows' reads inside written cells
+        if (lo > 1) row[lo - 1] = cap;
+        if (hi < base_d2 - 1) row[hi + 1] = cap;
+        forest_row_terms(row, row - base_d2, fd + r * base_d2, td_row, t2->leftmost, t2->labels, l2,
+                         lo, hi, idx1, idx1 - lm1, r, lm1 == l1, label1, bound);
+        // Insert term: a sequential min-plus scan along the row
+        for (int dj = lo; dj <= hi; dj++) {
+            int insert_cost = row[dj - 1] + cost_insert(t2->labels[l2 + dj - 1]);
+            if (insert_cost < row[dj]) row[dj] = insert_cost;
+        }
+        // Cells on both leftmost paths are whole-subtree distances
+        if (lm1 == l1) {
+            for (int dj = lo; dj <= hi; dj++) {
+                int idx2 = l2 + dj - 1;
+                if (t2->leftmost[idx2] == l2) td_row[idx2] = row[dj];
+            }
+        }
+    }
+}
+
+// Cells forest_dist evaluates for keyroot pair (i, j): the rows x cols table,
+// or its diagonal band of half-width bound. Counted here rather than in the
+// row loop, which is measurably slower with the extra bookkeeping
+static int64_t forest_cells(int rows, int cols, int bound) {
+    if (bound >= rows && bound >= cols) return (int64_t)rows * cols;
+    int64_t cells = 0;
+    for (int di = 1; di <= rows; di++) {
+        int lo = di - bound > 1 ? di - bound : 1;
+        int hi = di + bound < cols ? di + bound : cols;
+        if (hi >= lo) cells += hi - lo + 1;
+    }
+    return cells;
+}
+
+// Leftmost-path nodes of keyroot k in postorder; returns their number
+static int leftmost_path(const TreeInfo* ti, int k, int32_t* path) {
+    int l = ti->leftmost[k];
+    int len = 0;
+    for (int x = l; x <= k; x++) {
+        if (ti->leftmost[x] == l) path[len++] = x;
+    }
+    return len;
+}
+
+static void fill_tree_edit_matrix(const TreeInfo* t1, const TreeInfo* t2, Workspace* ws, int bound) {
+    int* treedist = ws->treedist;
+    int n = t2->postorder_size;
+    // Cached blocks are exact distances, so bounded runs, whose values also
+    // depend on postorder positions, do not use the cache
+    SubtreeCache* cache = bound >= NO_BOUND ? ws->cache : NULL;
+    int64_t keyroot_pairs = 0;
+    int64_t cells = 0;
+    int64_t hits = 0;
+    for (int ki = 0; ki < t1->num_keyroots; ki++) {
+        int i = t1->keyroots[ki];
+        int l1 = t1->leftmost[i];
+        int len1 = -1;
+        for (int kj = 0; kj < t2->num_keyroots; kj++) {
+            int j = t2->keyroots[kj];
+            int l2 = t2->leftmost[j];
+            // Skip pairs whose subtrees lie more than bound postorder
+            // positions apart; none of their nodes can be matched
+            if (l2 - i > bound || l1 - j > bound) continue;
+            if (!cache || (i - l1 + 1) * (j - l2 + 1) < CACHE_MIN_CELLS) {
+                forest_dist(i, j, t1, t2, treedist, ws->fd, bound);
+                cells += forest_cells(i - l1 + 1, j - l2 + 1, bound);
+                keyroot_pairs++;
+                continue;
+            }
+            if (len1 < 0) len1 = leftmost_path(t1, i, ws->path1);
+            int len2 = leftmost_path(t2, j, ws->path2);
+            uint64_t hash1 = t1->keyroot_hash[ki];
+            uint64_t hash2 = t2->keyroot_hash[kj];
+            if (cache_lookup(cache, hash1, hash2, ws->path1, len1, ws->path2, len2, treedist, n)) {
+                hits++;
+                continue;
+            }
+            forest_dist(i, j, t1, t2, treedist, ws->fd, bound);
+            cells += forest_cells(i - l1 + 1, j - l2 + 1, bound);
+            keyroot_pairs++;
+            cache_store(cache, hash1, hash2, ws->path1, len1, ws->path2, len2, treedist, n);
+        }
+    }
+    WorkCounters* counters = ws->counters;
+    counter_add(&counters->keyroot_pairs, keyroot_pairs);
+    counter_add(&counters->dp_cells, cells);
+    if (hits > 0) counter_add(&counters->cache_hits, hits);
+}
+
+// Both trees of a pair must have the same orientation. Zhang-Shasha solves
+// keyroot_cost(t1) * keyroot_cost(t2) subproblems; mirrored trees run the
+// right-path decomposition instead
+static void choose_orientation(const TreeInfo** t1, const TreeInfo** t2) {
+    const TreeInfo* a = *t1;
+    const TreeInfo* b = *t2;
+    if (a->mirrored != b->mirrored) {
+        // A right-path tree paired with an auto one: only the latter has both
+        if (a->mirror) *t1 = a->mirror;
+        if (b->mirror) *t2 = b->mirror;
+    } else if (a->mirror && b->mirror && a->mirror->keyroot_cost * b->mirror->keyroot_cost < a->keyroot_cost * b->keyroot_cost) {
+        *t1 = a->mirror;
+        *t2 = b->mirror;
+    }
+}
+
+// Exact distance if it is <= bound, otherwise bound + 1
+int tree_edit_dist_bounded(const TreeInfo* t1, const TreeInfo* t2, int bound, Workspace* ws) {
+    int m = t1->postorder_size;
+    int n = t2->postorder_size;
+    counter_add(&ws->counters->pairs, 1);
+    if (abs(m - n) > bound) return bound + 1;
+    choose_orientation(&t1, &t2);
+    double start = ws->counters->timed ? omp_get_wtime() : 0;
+    // Keyroot pairs are visited in postorder, so every treedist cell is written
+    // by an earlier forest_dist call before a later one reads it; the buffer
+    // can therefore be reused across pairs without clearing
+    fill_tree_edit_matrix(t1, t2, ws, bound);
+    if (ws->counters->timed) counter_add(&ws->counters->busy_ns, (int64_t)((omp_get_wtime() - start) * 1e9));
+    return min(ws->treedist[(m - 1) * n + (n - 1)], bound + 1);
+}
+
+int tree_edit_dist(const TreeInfo* t1, const TreeInfo* t2, Workspace* ws) {
+    return tree_edit_dist_bounded(t1, t2, NO_BOUND, ws);
+}
+
+// Nesting depth of each keyroot: 0 if no other keyroot lies in its subtree,
+// otherwise one more than the deepest keyroot inside. Keyroots are sorted
+// by postorder, so the ones inside keyroot k are those in [leftmost[k], k)
+static void keyroot_levels(const TreeInfo* ti, int* level, int* max_level) {
+    *max_level = 0;
+    for (int k = 0; k < ti->num_keyroots; k++) {
+        int l = ti->leftmost[ti->keyroots[k]];
+        level[k] = 0;
+        for (int q = k - 1; q >= 0 && ti->keyroots[q] >= l; q--) {
+            if (level[q] + 1 > level[k]) level[k] = level[q] + 1;
+        }
+        if (level[k] > *max_level) *max_level = level[k];
+    }
+}
+
+// Exact distance of a single pair, with its keyroot pairs spread over the
+// threads. forest_dist(i, j) only reads treedist cells written by keyroot
+// pairs nested inside (i, j), whose level sum is strictly smaller, so all
+// pairs with the same level sum form one wavefront that can run
+// concurrently. treedist is shared (pool[0]); every thread has its own fd.
+// Returns -1 if the wavefront lists cannot be allocated
+int tree_edit_dist_parallel(const TreeInfo* t1, const TreeInfo* t2, Workspace** pool, int pool_size) {
+    choose_orientation(&t1, &t2);
+    int m = t1->postorder_size;
+    int n = t2->postorder_size;
+    int k1 = t1->num_keyroots;
+    int k2 = t2->num_keyroots;
+    // Levels are below the keyroot counts, so there are fewer than k1 + k2
+    // waves; all lists share one allocation
+    int* level1 = calloc((size_t)k1 * k2 + 3 * (size_t)(k1 + k2) + 1, sizeof(int));
+    if (!level1) return -1;
+    int* level2 = level1 + k1;
+    int* wave_start = level2 + k2;
+    int* wave_fill = wave_start + k1 + k2 + 1;
+    int* pairs = wave_fill + k1 + k2;
+    int max_level1, max_level2;
+    keyroot_levels(t1, level1, &max_level1);
+    keyroot_levels(t2, level2, &max_level2);
+
+    // Keyroot pairs bucketed by level sum (counting sort)
+    int num_waves = max_level1 + max_level2 + 1;
+    for (int ki = 0; ki < k1; ki++) {
+        for (int kj = 0; kj < k2; kj++) {
+            wave_start[level1[ki] + level2[kj] + 1]++;
+        }
+    }
+    for (int s = 0; s < num_waves; s++) {
+        wave_start[s + 1] += wave_start[s];
+    }
+    memcpy(wave_fill, wave_start, num_waves * sizeof(int));
+    for (int ki = 0; ki < k1; ki++) {
+        for (int kj = 0; kj < k2; kj++) {
+            pairs[wave_fill[level1[ki] + level2[kj]]++] = ki * k2 + kj;
+        }
+    }
+
+    int* treedist = pool[0]->treedist;
+    counter_add(&pool[0]->counters->pairs, 1);
+    #pragma omp parallel num_threads(pool_size)
+    {
+        Workspace* ws = pool[omp_get_thread_num()];
+        int64_t keyroot_pairs = 0;
+        int64_t cells = 0;
+        double busy = 0;
+        for (int s = 0; s < num_waves; s++) {
+            double start = ws->counters->timed ? omp_get_wtime() : 0;
+            #pragma omp for schedule(dynamic) nowait
+            for (int p = wave_start[s]; p < wave_start[s + 1]; p++) {
+                int ki = pairs[p] / k2;
+                int kj = pairs[p] % k2;
+                int i = t1->keyroots[ki];
+                int j = t2->keyroots[kj];
+                forest_dist(i, j, t1, t2, treedist, ws->fd, NO_BOUND);
+                cells += (int64_t)(i - t1->leftmost[i] + 1) * (j - t2->leftmost[j] + 1);
+                keyroot_pairs++;
+            }
+            // Waiting for the rest of the wave is idle time
+            if (ws->counters->timed) busy += omp_get_wtime() - start;
+            #pragma omp barrier
+        }
+        counter_add(&ws->counters->keyroot_pairs, keyroot_pairs);
+        counter_add(&ws->counters->dp_cells, cells);
+        if (ws->counters->timed) counter_add(&ws->counters->busy_ns, (int64_t)(busy * 1e9));
+    }
+    free(level1);
+    return treedist[(m - 1) * n + (n - 1)];
+}
+
+// Few, large pairs leave most threads idle when pairs are distributed, so
+// their keyroot pairs are parallelised instead
+int use_intra_pair(long long num_pairs, int max_nodes, int num_threads) {
+    return num_threads > 1 && num_pairs < 2LL * num_threads && max_nodes >= INTRA_PAIR_MIN_NODES;
+}
+
+Workspace** create_workspace_pool(int max_nodes, int count, SubtreeCache* cache) {
+    Workspace** pool = malloc(count * sizeof(Workspace*));
+    if (!pool) return NULL;
+    for (int t = 0; t < count; t++) {
+        pool[t] = create_workspace(max_nodes, cache);
+        if (!pool[t]) {
+            free_workspace_pool(pool, t);
+            return NULL;
+        }
+    }
+    return pool;
+}
+
+void free_workspace_pool(Workspace** pool, int count) {
+    if (!pool) return;
+    for (int t = 0; t < count; t++) {
+        free_workspace(pool[t]);
+    }
+    free(pool);
+}
+
+// Cheap lower bound: the cheapest way to turn the label multiset of t1 into
+// that of t2, ignoring tree structure. Surplus pairs on one side and surplus
+// unpaired bases on the other are relabelled (1), the rest deleted or
+// inserted (2 per pair, 1 per unpaired base)
+int ted_lower_bound(const TreeInfo* t1, const TreeInfo* t2) {
+    return label_count_bound(t1->num_pairs, t1->num_unpaired, t2->num_pairs, t2->num_unpaired);
+}
+
+int label_count_bound(int pairs1, int unpaired1, int pairs2, int unpaired2) {
+    int dp = abs(pairs1 - pairs2);
+    int du = abs(unpaired1 - unpaired2);
+    int opposite = (pairs1 > pairs2) != (unpaired1 > unpaired2);
+    int relabel = opposite ? min(dp, du) : 0;
+    return 2 * dp + du - 2 * relabel;
+}
+
+// Checks the dot-bracket syntax, so that the tree builders can assume a
+// well-formed structure
+static RnatedStatus validate_structure(const char* db, size_t len, size_t* error_pos) {
+    size_t depth = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (db[i] == '(') {
+            depth++;
+        } else if (db[i] == ')') {
+            if (depth == 0) {
+                if (error_pos) *error_pos = i;
+                return RNATED_ERROR_UNMATCHED_CLOSE;
+            }
+            depth--;
+        } else if (db[i] != '.') {
+            if (error_pos) *error_pos = i;
+            return RNATED_ERROR_INVALID_CHARACTER;
+        }
+    }
+    if (depth != 0) {
+        if (error_pos) *error_pos = len;
+        return RNATED_ERROR_UNBALANCED;
+    }
+    return RNATED_OK;
+}
+
+const char* rnated_status_message(RnatedStatus status) {
+    switch (status) {
+        case RNATED_OK: return "Success";
+        case RNATED_ERROR_INVALID_ARGUMENT: return "Invalid argument";
+        case RNATED_ERROR_OUT_OF_MEMORY: return "Memory allocation failed";
+        case RNATED_ERROR_INVALID_CHARACTER: return "Invalid character";
+        case RNATED_ERROR_UNMATCHED_CLOSE: return "Unmatched closing parenthesis";
+        case RNATED_ERROR_UNBALANCED: return "Unbalanced parentheses";
+    }
+    return "Unknown error";
+}
+
+// With RNATED_ALGORITHM_RIGHT the mirrored tree becomes the primary one
+RnatedStatus rnated_parse(const char* structure, size_t length, RnatedAlgorithm algorithm,
+                          RnatedTree** tree, size_t* error_position) {
+    if (!structure || !tree || length >= INT_MAX) return RNATED_ERROR_INVALID_ARGUMENT;
+    *tree = NULL;
+    RnatedStatus status = validate_structure(structure, length, error_position);
+    if (status != RNATED_OK) return status;
+    int len = (int)length;
+    TreeInfo* ti;
+    if (algorithm == RNATED_ALGORITHM_RIGHT) {
+        ti = compute_mirrored_tree_info(structure, len);
+    } else {
+        ti = compute_tree_info(structure, len);
+        if (ti && algorithm == RNATED_ALGORITHM_AUTO) {
+            ti->mirror = compute_mirrored_tree_info(structure, len);
+            if (!ti->mirror) {
+                free_tree_info(ti);
+                ti = NULL;
+            }
+        }
+    }
+    if (!ti) return RNATED_ERROR_OUT_OF_MEMORY;
+    *tree = ti;
+    return RNATED_OK;
+}
+
+void rnated_tree_free(RnatedTree* tree) {
+    if (tree) free_tree_info(tree);
+}
+
+int rnated_tree_size(const RnatedTree* tree) {
+    return tree->postorder_size;
+}
+
+RnatedStatus rnated_workspace_create(RnatedCache* cache, RnatedWorkspace** workspace) {
+    if (!workspace) return RNATED_ERROR_INVALID_ARGUMENT;
+    *workspace = create_workspace(0, cache);
+    return *workspace ? RNATED_OK : RNATED_ERROR_OUT_OF_MEMORY;
+}
+
+void rnated_workspace_free(RnatedWorkspace* workspace) {
+    free_workspace(workspace);
+}
+
+RnatedStatus rnated_cache_create(size_t budget_bytes, RnatedCache** cache) {
+    if (!cache || budget_bytes == 0) return RNATED_ERROR_INVALID_ARGUMENT;
+    *cache = create_subtree_cache(budget_bytes);
+    return *cache ? RNATED_OK : RNATED_ERROR_OUT_OF_MEMORY;
+}
+
+void rnated_cache_free(RnatedCache* cache) {
+    free_subtree_cache(cache);
+}
+
+// Counters are read without the shard locks, so they are approximate while
+// other threads use the cache
+void rnated_cache_stats(const RnatedCache* cache, long long* hits, long long* misses, size_t* bytes) {
+    long long total_hits = 0;
+    long long total_misses = 0;
+    size_t total_bytes = 0;
+    for (int s = 0; s < CACHE_SHARDS; s++) {
+        total_hits += cache->shards[s].hits;
+        total_misses += cache->shards[s].misses;
+        total_bytes += cache->shards[s].bytes;
+    }
+    if (hits) *hits = total_hits;
+    if (misses) *misses = total_misses;
+    if (bytes) *bytes = total_bytes;
+}
+
+// Whether a tree is available unmirrored (1), mirrored (2) or both (3)
+static int orientations(const TreeInfo* ti) {
+    return (ti->mirrored ? 2 : 1) | (ti->mirror ? 3 : 0);
+}
+
+RnatedStatus rnated_distance_bounded(const RnatedTree* a, const RnatedTree* b, int32_t bound,
+                                     RnatedWorkspace* workspace, int32_t* distance) {
+    if (!a || !b || !workspace || !distance || bound < 0) return RNATED_ERROR_INVALID_ARGUMENT;
+    if (!(orientations(a) & orientations(b))) return RNATED_ERROR_INVALID_ARGUMENT;
+    if (reserve_workspace(workspace, a->postorder_size > b->postorder_size ? a->postorder_size : b->postorder_size) != 0) {
+        return RNATED_ERROR_OUT_OF_MEMORY;
+    }
+    *distance = tree_edit_dist_bounded(a, b, bound < NO_BOUND ? bound : NO_BOUND, workspace);
+    return RNATED_OK;
+}
+
+RnatedStatus rnated_distance(const RnatedTree* a, const RnatedTree* b, RnatedWorkspace* workspace,
+                             int32_t* distance) {
+    return rnated_distance_bounded(a, b, NO_BOUND, workspace, distance);
+}
+
+static int largest_tree(const TreeInfo* const* trees, size_t count) {
+    int largest = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (trees[i]->postorder_size > largest) largest = trees[i]->postorder_size;
+    }
+    return largest;
+}
+
+// Shared driver of the batch calls: the pairs (rows[i], cols[j]) with
+// i < j if condensed, all of them otherwise, are written in row-major
+// order. Each thread uses its own workspace of the pool; few large pairs
+// are parallelised internally instead (see tree_edit_dist_parallel)
+static RnatedStatus compute_batch(const TreeInfo* const* rows, size_t num_rows, const TreeInfo* const* cols,
+                                  size_t num_cols, int condensed, SubtreeCache* cache, int num_threads,
+                                  int32_t* distances) {
+    if ((num_rows > 0 && !rows) || (num_cols > 0 && !cols) || !distances || num_threads < 0) {
+        return RNATED_ERROR_INVALID_ARGUMENT;
+    }
+    // A left-only tree cannot be paired with a right-only one
+    int row_only = 0;
+    int col_only = 0;
+    for (size_t i = 0; i < num_rows; i++) {
+        if (!rows[i]) return RNATED_ERROR_INVALID_ARGUMENT;
+        if (orientations(rows[i]) != 3) row_only |= orientations(rows[i]);
+    }
+    for (size_t j = 0; j < num_cols; j++) {
+        if (!cols[j]) return RNATED_ERROR_INVALID_ARGUMENT;
+        if (orientations(cols[j]) != 3) col_only |= orientations(cols[j]);
+    }
+    if (((row_only & 1) && (col_only & 2)) || ((row_only & 2) && (col_only & 1))) return RNATED_ERROR_INVALID_ARGUMENT;
+    size_t num_pairs = condensed ? (num_rows > 1 ? num_rows * (num_rows - 1) / 2 : 0) : num_rows * num_cols;
+    if (num_pairs == 0) return RNATED_OK;
+    if (num_threads == 0) num_threads = omp_get_max_threads();
+    int max_nodes = largest_tree(rows, num_rows);
+    int col_nodes = largest_tree(cols, num_cols);
+    if (col_nodes > max_nodes) max_nodes = col_nodes;
+
+    int intra = use_intra_pair((long long)num_pairs, max_nodes, num_threads);
+    Workspace** pool = create_workspace_pool(max_nodes, num_threads, cache);
+    if (!pool) return RNATED_ERROR_OUT_OF_MEMORY;
+    RnatedStatus status = RNATED_OK;
+    if (intra) {
+        size_t p = 0;
+        for (size_t i = 0; i < num_rows && status == RNATED_OK; i++) {
+            for (size_t j = condensed ? i + 1 : 0; j < num_cols; j++) {
+                int ted = tree_edit_dist_parallel(rows[i], cols[j], pool, num_threads);
+                if (ted < 0) {
+                    status = RNATED_ERROR_OUT_OF_MEMORY;
+                    break;
+                }
+                distances[p++] = ted;
+            }
+        }
+    } else {
+        // Rows of the condensed triangle shrink, so they are handed out
+        // dynamically one at a time
+        #pragma omp parallel for schedule(dynamic) num_threads(num_threads)
+        for (size_t i = 0; i < num_rows; i++) {
+            Workspace* ws = pool[omp_get_thread_num()];
+            size_t j0 = condensed ? i + 1 : 0;
+            int32_t* out = distances + (condensed ? i * num_rows - i * (i + 1) / 2 : i * num_cols);
+            for (size_t j = j0; j < num_cols; j++) {
+                out[j - j0] = tree_edit_dist(rows[i], cols[j], ws);
+            }
+        }
+    }
+    free_workspace_pool(pool, num_threads);
+    return status;
+}
+
+RnatedStatus rnated_one_to_many(const RnatedTree* query, const RnatedTree* const* targets, size_t num_targets,
+                                RnatedCache* cache, int num_threads, int32_t* distances) {
+    if (!query) return RNATED_ERROR_INVALID_ARGUMENT;
+    return compute_batch(&query, 1, targets, num_targets, 0, cache, num_threads, distances);
+}
+
+RnatedStatus rnated_many_to_many(const RnatedTree* const* rows, size_t num_rows,
+                                 const RnatedTree* const* cols, size_t num_cols,
+                                 RnatedCache* cache, int num_threads, int32_t* distances) {
+    return compute_batch(rows, num_rows, cols, num_cols, 0, cache, num_threads, distances);
+}
+
+RnatedStatus rnated_condensed(const RnatedTree* const* trees, size_t num_trees,
+                              RnatedCache* cache, int num_threads, int32_t* distances) {
+    return compute_batch(trees, num_trees, trees, num_trees, 1, cache, num_threads, distances);
+}
@@ -0,0 +1,91 @@
+#ifndef RNATED_H
+#define RNATED_H
+
+// Tree edit distance between RNA secondary structures in dot-bracket
+// notation, as a library. Parsed trees are immutable and can be shared by
+// any number of threads; a workspace belongs to one thread at a time. No
+// function prints or exits: errors are returned as RnatedStatus codes.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(__GNUC__)
+#define RNATED_API __attribute__((visibility("default")))
+#else
+#define RNATED_API
+#endif
+
+typedef enum RnatedStatus {
+    RNATED_OK = 0,
+    RNATED_ERROR_INVALID_ARGUMENT,
+    RNATED_ERROR_OUT_OF_MEMORY,
+    RNATED_ERROR_INVALID_CHARACTER,
+    RNATED_ERROR_UNMATCHED_CLOSE,  // ')' without an open pair
+    RNATED_ERROR_UNBALANCED        // '(' still open at the end
+} RnatedStatus;
+
+// Tree decomposition used for a pair (see --algorithm). AUTO keeps both
+// orientations of every tree and picks the cheaper one per pair. A RIGHT
+// tree can be compared with RIGHT and AUTO trees, a LEFT tree with LEFT and
+// AUTO trees; other pairs fail with RNATED_ERROR_INVALID_ARGUMENT
+typedef enum RnatedAlgorithm {
+    RNATED_ALGORITHM_AUTO = 0,
+    RNATED_ALGORITHM_LEFT,
+    RNATED_ALGORITHM_RIGHT
+} RnatedAlgorithm;
+
+typedef struct TreeInfo RnatedTree;          // Parsed structure
+typedef struct Workspace RnatedWorkspace;    // Per-thread scratch buffers
+typedef struct SubtreeCache RnatedCache;     // Substructure results shared by threads
+
+RNATED_API const char* rnated_status_message(RnatedStatus status);
+
+// Parses length characters of dot-bracket text (no terminator needed). On a
+// syntax error, error_position (if not NULL) receives the offending offset
+RNATED_API RnatedStatus rnated_parse(const char* structure, size_t length, RnatedAlgorithm algorithm,
+                                     RnatedTree** tree, size_t* error_position);
+RNATED_API void rnated_tree_free(RnatedTree* tree);
+// Number of tree nodes: one per base pair and unpaired base, plus the root
+RNATED_API int rnated_tree_size(const RnatedTree* tree);
+
+// cache may be NULL. The workspace grows to the largest trees it sees
+RNATED_API RnatedStatus rnated_workspace_create(RnatedCache* cache, RnatedWorkspace** workspace);
+RNATED_API void rnated_workspace_free(RnatedWorkspace* workspace);
+
+// Substructure cache of about budget_bytes, safe to share between threads
+// and calls. Only exact distances use it
+RNATED_API RnatedStatus rnated_cache_create(size_t budget_bytes, RnatedCache** cache);
+RNATED_API void rnated_cache_free(RnatedCache* cache);
+RNATED_API void rnated_cache_stats(const RnatedCache* cache, long long* hits, long long* misses, size_t* bytes);
+
+RNATED_API RnatedStatus rnated_distance(const RnatedTree* a, const RnatedTree* b, RnatedWorkspace* workspace,
+                                        int32_t* distance);
+// Exact distance if it is <= bound, otherwise bound + 1; much faster for
+// small bounds
+RNATED_API RnatedStatus rnated_distance_bounded(const RnatedTree* a, const RnatedTree* b, int32_t bound,
+                                                RnatedWorkspace* workspace, int32_t* distance);
+
+// Batch calls distribute the pairs over num_threads threads (0: OpenMP
+// default), each with its own workspace, and write into caller buffers.
+// cache may be NULL.
+// distances[j] = d(query, targets[j])
+RNATED_API RnatedStatus rnated_one_to_many(const RnatedTree* query, const RnatedTree* const* targets, size_t num_targets,
+                                           RnatedCache* cache, int num_threads, int32_t* distances);
+// distances[i * num_cols + j] = d(rows[i], cols[j])
+RNATED_API RnatedStatus rnated_many_to_many(const RnatedTree* const* rows, size_t num_rows,
+                                            const RnatedTree* const* cols, size_t num_cols,
+                                            RnatedCache* cache, int num_threads, int32_t* distances);
+// All pairs i < j of one set in condensed (scipy pdist) order,
+// num_trees * (num_trees - 1) / 2 values
+RNATED_API RnatedStatus rnated_condensed(const RnatedTree* const* trees, size_t num_trees,
+                                         RnatedCache* cache, int num_threads, int32_t* distances);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,737 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <omp.h>
+#include <getopt.h>
+#include <unistd.h>
+#include "rnated.h"
+
+// Benchmarks and cross-checks for the distance engine on reproducible
+// random structures. Results are tab-separated lines on standard output;
+// a previous results file can be given as a baseline to spot regressions.
+
+#define DEFAULT_STRUCTURES 200
+#define DEFAULT_LENGTH 200
+#define DEFAULT_PAIRING 0.6
+#define DEFAULT_BRANCHING 0.3
+#define DEFAULT_DUPLICATES 0.1
+#define DEFAULT_CHECK_PAIRS 500
+#define DEFAULT_TOLERANCE 10.0
+#define CHECK_LENGTH 32         // The naive reference's memo grows with the fourth power of the size
+#define MICRO_BOUND 10
+#define CACHE_MB 256
+#define MAX_BASELINE 256
+#define SHARD_CHECK_STRUCTURES 1100  // More than a tile edge squared, so the duplicate map outgrows a tile
+
+typedef struct GeneratorParams {
+    int length;          // Mean structure length; lengths vary by +-10%
+    double pairing;      // Chance of opening a helix at each unpaired position
+    double branching;    // Chance that a helix leaves room for siblings
+    double duplicates;   // Fraction of structures that repeat an earlier one
+} GeneratorParams;
+
+typedef struct Result {
+    char name[32];
+    int threads;
+    double pairs;
+    double seconds;
+    double pairs_per_second;
+} Result;
+
+// Postorder tree built independently of the engine for the reference
+typedef struct NaiveTree {
+    int size;
+    char* labels;
+    int* leftmost;
+} NaiveTree;
+
+// Forest distance memo over postorder ranges [a1, b1] x [a2, b2]
+typedef struct NaiveMemo {
+    const NaiveTree* t1;
+    const NaiveTree* t2;
+    int* values;
+} NaiveMemo;
+
+// Function declarations
+uint64_t next_random(uint64_t* state);
+double random_unit(uint64_t* state);
+void generate_region(char* out, int length, const GeneratorParams* params, uint64_t* state);
+char** generate_structures(int count, const GeneratorParams* params, uint64_t seed);
+void free_strings(char** strings, int count);
+int count_unique(char** structures, int count);
+RnatedTree** parse_all(char** structures, int count, RnatedAlgorithm algorithm);
+void free_trees(RnatedTree** trees, int count);
+NaiveTree* parse_naive(const char* structure);
+void free_naive(NaiveTree* tree);
+int naive_forest_dist(NaiveMemo* memo, int a1, int b1, int a2, int b2);
+int naive_distance(const NaiveTree* t1, const NaiveTree* t2);
+int cross_check(int num_pairs, const GeneratorParams* params, uint64_t seed);
+double run_command(const char* command);
+int files_equal(const char* path1, const char* path2);
+int shard_check(const char* program, const GeneratorParams* params, uint64_t seed);
+void report(Result* results, int* num_results, const char* name, int threads, double pairs, double seconds);
+int load_baseline(const char* path, Result* baseline);
+
+uint64_t next_random(uint64_t* state) {
+    // xorshift64*
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+double random_unit(uint64_t* state) {
+    return (next_random(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Fills length characters with a structure: helices of stacked pairs
+// enclosing recursively generated loops, separated by unpaired bases
+void generate_region(char* out, int length, const GeneratorParams* params, uint64_t* state) {
+    int pos = 0;
+    while (pos < length) {
+        int remaining = length - pos;
+        // A hairpin needs a pair and at least three unpaired bases
+        if (remaining < 5 || random_unit(state) >= params->pairing) {
+            out[pos++] = '.';
+            continue;
+        }
+        int span = remaining;
+        if (random_unit(state) < params->branching) {
+            span = 5 + (int)(next_random(state) % (uint64_t)(remaining - 4));
+        }
+        int stem = 1;
+        while (span - 2 * (stem + 1) >= 3 && random_unit(state) < 0.75) stem++;
+        memset(out + pos, '(', stem);
+        generate_region(out + pos + stem, span - 2 * stem, params, state);
+        memset(out + pos + span - stem, ')', stem);
+        pos += span;
+    }
+}
+
+char** generate_structures(int count, const GeneratorParams* params, uint64_t seed) {
+    uint64_t state = seed * 0x9E3779B97F4A7C15ULL + 1;
+    char** structures = malloc(count * sizeof(char*));
+    if (!structures) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    for (int i = 0; i < count; i++) {
+        if (i > 0 && random_unit(&state) < params->duplicates) {
+            structures[i] = strdup(structures[next_random(&state) % (uint64_t)i]);
+        } else {
+            int spread = params->length / 10;
+            int length = params->length - spread + (int)(next_random(&state) % (uint64_t)(2 * spread + 1));
+            if (length < 1) length = 1;
+            structures[i] = malloc(length + 1);
+            if (structures[i]) {
+                generate_region(structures[i], length, params, &state);
+                structures[i][length] = 0;
+            }
+        }
+        if (!structures[i]) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+    }
+    return structures;
+}
+
+void free_strings(char** strings, int count) {
+    for (int i = 0; i < count; i++) free(strings[i]);
+    free(strings);
+}
+
+static int compare_strings(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+// Distinct structures, which is what the command line tool computes on
+int count_unique(char** structures, int count) {
+    char** sorted = malloc(count * sizeof(char*));
+    if (!sorted) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    memcpy(sorted, structures, count * sizeof(char*));
+    qsort(sorted, count, sizeof(char*), compare_strings);
+    int unique = count > 0;
+    for (int i = 1; i < count; i++) {
+        if (strcmp(sorted[i - 1], sorted[i]) != 0) unique++;
+    }
+    free(sorted);
+    return unique;
+}
+
+RnatedTree** parse_all(char** structures, int count, RnatedAlgorithm algorithm) {
+    RnatedTree** trees = malloc(count * sizeof(RnatedTree*));
+    if (!trees) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    for (int i = 0; i < count; i++) {
+        RnatedStatus status = rnated_parse(structures[i], strlen(structures[i]), algorithm, &trees[i], NULL);
+        if (status != RNATED_OK) {
+            fprintf(stderr, "Failed to parse generated structure %d: %s\n", i, rnated_status_message(status));
+            exit(1);
+        }
+    }
+    return trees;
+}
+
+void free_trees(RnatedTree** trees, int count) {
+    for (int i = 0; i < count; i++) rnated_tree_free(trees[i]);
+    free(trees);
+}
+
+NaiveTree* parse_naive(const char* structure) {
+    int len = strlen(structure);
+    NaiveTree* tree = malloc(sizeof(NaiveTree));
+    int* open = malloc((len + 1) * sizeof(int));
+    if (!tree || !open) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    tree->labels = malloc(len + 1);
+    tree->leftmost = malloc((len + 1) * sizeof(int));
+    if (!tree->labels || !tree->leftmost) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    int size = 0;
+    int depth = 0;
+    for (int i = 0; i < len; i++) {
+        if (structure[i] == '(') {
+            open[depth++] = size;
+        } else if (structure[i] == ')') {
+            tree->labels[size] = 'P';
+            tree->leftmost[size++] = open[--depth];
+        } else {
+            tree->labels[size] = 'U';
+            tree->leftmost[size] = size;
+            size++;
+        }
+    }
+    tree->labels[size] = 'R';
+    tree->leftmost[size++] = 0;
+    tree->size = size;
+    free(open);
+    return tree;
+}
+
+void free_naive(NaiveTree* tree) {
+    free(tree->labels);
+    free(tree->leftmost);
+    free(tree);
+}
+
+static int naive_cost(char label) {
+    return label == 'P' ? 2 : 1;
+}
+
+// Textbook recursion on the rightmost roots v and w of two forests: delete
+// v, insert w, or match them, which splits both forests into the subtrees
+// below v and w and the forests left of them
+int naive_forest_dist(NaiveMemo* memo, int a1, int b1, int a2, int b2) {
+    const NaiveTree* t1 = memo->t1;
+    const NaiveTree* t2 = memo->t2;
+    if (b1 < a1) {
+        int cost = 0;
+        for (int k = a2; k <= b2; k++) cost += naive_cost(t2->labels[k]);
+        return cost;
+    }
+    if (b2 < a2) {
+        int cost = 0;
+        for (int k = a1; k <= b1; k++) cost += naive_cost(t1->labels[k]);
+        return cost;
+    }
+    int m = t1->size;
+    int n = t2->size;
+    int* value = &memo->values[((size_t)a1 * m + b1) * n * n + (size_t)a2 * n + b2];
+    if (*value >= 0) return *value;
+    int l1 = t1->leftmost[b1];
+    int l2 = t2->leftmost[b2];
+    int best = naive_forest_dist(memo, a1, b1 - 1, a2, b2) + naive_cost(t1->labels[b1]);
+    int insert = naive_forest_dist(memo, a1, b1, a2, b2 - 1) + naive_cost(t2->labels[b2]);
+    if (insert < best) best = insert;
+    int match = naive_forest_dist(memo, a1, l1 - 1, a2, l2 - 1) + naive_forest_dist(memo, l1, b1 - 1, l2, b2 - 1) +
+                (t1->labels[b1] != t2->labels[b2]);
+    if (match < best) best = match;
+    *value = best;
+    return best;
+}
+
+int naive_distance(const NaiveTree* t1, const NaiveTree* t2) {
+    size_t cells = (size_t)t1->size * t1->size * t2->size * t2->size;
+    NaiveMemo memo = {t1, t2, malloc(cells * sizeof(int))};
+    if (!memo.values) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    memset(memo.values, 0xff, cells * sizeof(int));
+    int d = naive_forest_dist(&memo, 0, t1->size - 1, 0, t2->size - 1);
+    free(memo.values);
+    return d;
+}
+
+// Compares every engine variant with the naive reference on random pairs
+// of short structures. Returns the number of mismatches
+int cross_check(int num_pairs, const GeneratorParams* params, uint64_t seed) {
+    GeneratorParams short_params = *params;
+    short_params.length = CHECK_LENGTH;
+    short_params.duplicates = 0;
+    int count = 2 * num_pairs;
+    char** structures = generate_structures(count, &short_params, seed + 1);
+    RnatedTree** left = parse_all(structures, count, RNATED_ALGORITHM_LEFT);
+    RnatedTree** right = parse_all(structures, count, RNATED_ALGORITHM_RIGHT);
+    RnatedTree** automatic = parse_all(structures, count, RNATED_ALGORITHM_AUTO);
+    RnatedWorkspace* ws;
+    RnatedWorkspace* cached_ws;
+    RnatedCache* cache;
+    if (rnated_workspace_create(NULL, &ws) != RNATED_OK || rnated_cache_create((size_t)CACHE_MB << 20, &cache) != RNATED_OK ||
+        rnated_workspace_create(cache, &cached_ws) != RNATED_OK) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+
+    int mismatches = 0;
+    for (int p = 0; p < num_pairs; p++) {
+        int a = 2 * p;
+        int b = 2 * p + 1;
+        NaiveTree* n1 = parse_naive(structures[a]);
+        NaiveTree* n2 = parse_naive(structures[b]);
+        int expected = naive_distance(n1, n2);
+        free_naive(n1);
+        free_naive(n2);
+
+        int32_t d[6];
+        rnated_distance(left[a], left[b], ws, &d[0]);
+        rnated_distance(right[a], right[b], ws, &d[1]);
+        rnated_distance(automatic[a], automatic[b], ws, &d[2]);
+        rnated_distance(automatic[a], automatic[b], cached_ws, &d[3]);
+        // Bounded results are exact up to the bound and bound + 1 above it
+        rnated_distance_bounded(automatic[a], automatic[b], expected, ws, &d[4]);
+        rnated_distance_bounded(automatic[a], automatic[b], expected > 0 ? expected - 1 : 0, ws, &d[5]);
+        if (d[0] != expected || d[1] != expected || d[2] != expected || d[3] != expected || d[4] != expected ||
+            d[5] != expected) {
+            if (mismatches < 10) {
+                fprintf(stderr, "Mismatch for\n  %s\n  %s\nreference %d, left %d, right %d, auto %d, cached %d, bounded %d/%d\n",
+                        structures[a], structures[b], expected, d[0], d[1], d[2], d[3], d[4], d[5]);
+            }
+            mismatches++;
+        }
+    }
+
+    rnated_workspace_free(ws);
+    rnated_workspace_free(cached_ws);
+    rnated_cache_free(cache);
+    free_trees(left, count);
+    free_trees(right, count);
+    free_trees(automatic, count);
+    free_strings(structures, count);
+    return mismatches;
+}
+
+// Wall-clock seconds of a shell command, or -1 if it failed
+double run_command(const char* command) {
+    double start = omp_get_wtime();
+    int status = system(command);
+    double seconds = omp_get_wtime() - start;
+    return status == 0 ? seconds : -1;
+}
+
+int files_equal(const char* path1, const char* path2) {
+    FILE* f1 = fopen(path1, "rb");
+    FILE* f2 = fopen(path2, "rb");
+    int equal = f1 && f2;
+    while (equal) {
+        int c1 = getc(f1);
+        int c2 = getc(f2);
+        if (c1 != c2) equal = 0;
+        if (c1 == EOF) break;
+    }
+    if (f1) fclose(f1);
+    if (f2) fclose(f2);
+    return equal;
+}
+
+// Runs the command line tool as two shards, merges them and compares the
+// result with a single condensed run. Returns 0 if both are identical
+int shard_check(const char* program, const GeneratorParams* params, uint64_t seed) {
+    GeneratorParams short_params = *params;
+    short_params.length = CHECK_LENGTH;
+    char** structures = generate_structures(SHARD_CHECK_STRUCTURES, &short_params, seed + 2);
+    char input_path[] = "/tmp/rnated_shard_XXXXXX";
+    int fd = mkstemp(input_path);
+    FILE* input = fd >= 0 ? fdopen(fd, "w") : NULL;
+    if (!input) {
+        fprintf(stderr, "Cannot create temporary input file\n");
+        exit(1);
+    }
+    for (int i = 0; i < SHARD_CHECK_STRUCTURES; i++) fprintf(input, "%s\n", structures[i]);
+    fclose(input);
+    free_strings(structures, SHARD_CHECK_STRUCTURES);
+
+    char full_path[64], shard0_path[64], shard1_path[64], merged_path[64];
+    snprintf(full_path, sizeof(full_path), "%s.full", input_path);
+    snprintf(shard0_path, sizeof(shard0_path), "%s.0", input_path);
+    snprintf(shard1_path, sizeof(shard1_path), "%s.1", input_path);
+    snprintf(merged_path, sizeof(merged_path), "%s.merged", input_path);
+    char command[1024];
+    int failed = 0;
+    snprintf(command, sizeof(command), "%s --format condensed < %s > %s 2> /dev/null", program, input_path, full_path);
+    failed |= run_command(command) < 0;
+    snprintf(command, sizeof(command), "%s --shard 0/2 --output %s < %s 2> /dev/null", program, shard0_path, input_path);
+    failed |= run_command(command) < 0;
+    snprintf(command, sizeof(command), "%s --shard 1/2 --output %s < %s 2> /dev/null", program, shard1_path, input_path);
+    failed |= run_command(command) < 0;
+    snprintf(command, sizeof(command), "%s merge --format condensed %s %s > %s 2> /dev/null",
+             program, shard0_path, shard1_path, merged_path);
+    failed |= run_command(command) < 0;
+    if (failed || !files_equal(full_path, merged_path)) failed = 1;
+    unlink(input_path);
+    unlink(full_path);
+    unlink(shard0_path);
+    unlink(shard1_path);
+    unlink(merged_path);
+    return failed;
+}
+
+void report(Result* results, int* num_results, const char* name, int threads, double pairs, double seconds) {
+    Result* r = &results[(*num_results)++];
+    snprintf(r->name, sizeof(r->name), "%s", name);
+    r->threads = threads;
+    r->pairs = pairs;
+    r->seconds = seconds;
+    r->pairs_per_second = seconds > 0 ? pairs / seconds : 0;
+}
+
+// Reads the benchmark, threads and pairs/s columns of a previous run
+int load_baseline(const char* path, Result* baseline) {
+    FILE* in = fopen(path, "r");
+    if (!in) {
+        fprintf(stderr, "Cannot open baseline %s\n", path);
+        exit(1);
+    }
+    char line[256];
+    int count = 0;
+    while (count < MAX_BASELINE && fgets(line, sizeof(line), in)) {
+        Result* r = &baseline[count];
+        if (sscanf(line, "%31s %d %lf %lf %lf", r->name, &r->threads, &r->pairs, &r->seconds, &r->pairs_per_second) == 5) {
+            count++;
+        }
+    }
+    fclose(in);
+    return count;
+}
+
+int main(int argc, char* argv[]) {
+    int opt;
+    int num_structures = DEFAULT_STRUCTURES;
+    GeneratorParams params = {DEFAULT_LENGTH, DEFAULT_PAIRING, DEFAULT_BRANCHING, DEFAULT_DUPLICATES};
+    uint64_t seed = 1;
+    int max_threads = omp_get_max_threads();
+    int check_pairs = DEFAULT_CHECK_PAIRS;
+    int generate_only = 0;
+    const char* program = "./RNAtedistance";
+    const char* output_path = NULL;
+    const char* baseline_path = NULL;
+    double tolerance = DEFAULT_TOLERANCE;
+
+    struct option long_options[] = {
+        {"help", no_argument, 0, 'h'},
+        {"structures", required_argument, 0, 'n'},
+        {"length", required_argument, 0, 'l'},
+        {"pairing", required_argument, 0, 'p'},
+        {"branching", required_argument, 0, 'b'},
+        {"duplicates", required_argument, 0, 'u'},
+        {"seed", required_argument, 0, 's'},
+        {"threads", required_argument, 0, 't'},
+        {"check-pairs", required_argument, 0, 'c'},
+        {"generate", no_argument, 0, 'g'},
+        {"program", required_argument, 0, 'x'},
+        {"output", required_argument, 0, 'o'},
+        {"baseline", required_argument, 0, 'B'},
+        {"tolerance", required_argument, 0, 'T'},
+        {0, 0, 0, 0}
+    };
+
+    while ((opt = getopt_long(argc, argv, "hn:l:p:b:u:s:t:c:gx:o:B:T:", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'h':
+                printf("Usage: %s [options]\n", argv[0]);
+                printf("Options:\n");
+                printf("  --help, -h         Display this help message\n");
+                printf("  --structures, -n   Number of generated structures (default: %d)\n", DEFAULT_STRUCTURES);
+                printf("  --length, -l       Mean structure length (default: %d)\n", DEFAULT_LENGTH);
+                printf("  --pairing, -p      Chance of opening a helix at an unpaired position (default: %.1f)\n", DEFAULT_PAIRING);
+                printf("  --branching, -b    Chance that a helix leaves room for siblings (default: %.1f)\n", DEFAULT_BRANCHING);
+                printf("  --duplicates, -u   Fraction of repeated structures (default: %.1f)\n", DEFAULT_DUPLICATES);
+                printf("  --seed, -s         Random seed (default: 1)\n");
+                printf("  --threads, -t      Largest thread count to benchmark (default: %d)\n", max_threads);
+                printf("  --check-pairs, -c  Pairs compared with the naive reference (default: %d, 0 skips)\n", DEFAULT_CHECK_PAIRS);
+                printf("  --generate, -g     Only write the generated structures to standard output\n");
+                printf("  --program, -x      Command line tool for end-to-end runs (default: ./RNAtedistance)\n");
+                printf("  --output, -o       Also write the results to a file\n");
+                printf("  --baseline, -B     Compare pairs/s with a previous results file\n");
+                printf("  --tolerance, -T    Slowdown in percent reported as a regression (default: %.0f)\n", DEFAULT_TOLERANCE);
+                return 0;
+            case 'n':
+                num_structures = atoi(optarg);
+                if (num_structures < 2) {
+                    fprintf(stderr, "Invalid number of structures: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'l':
+                params.length = atoi(optarg);
+                if (params.length <= 0) {
+                    fprintf(stderr, "Invalid length: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'p':
+                params.pairing = atof(optarg);
+                if (params.pairing < 0 || params.pairing > 1) {
+                    fprintf(stderr, "Invalid pairing density: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'b':
+                params.branching = atof(optarg);
+                if (params.branching < 0 || params.branching > 1) {
+                    fprintf(stderr, "Invalid branching: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'u':
+                params.duplicates = atof(optarg);
+                if (params.duplicates < 0 || params.duplicates >= 1) {
+                    fprintf(stderr, "Invalid duplication rate: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 's':
+                seed = strtoull(optarg, NULL, 10);
+                break;
+            case 't':
+                max_threads = atoi(optarg);
+                if (max_threads <= 0) {
+                    fprintf(stderr, "Invalid number of threads: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'c':
+                check_pairs = atoi(optarg);
+                if (check_pairs < 0) {
+                    fprintf(stderr, "Invalid number of check pairs: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'g':
+                generate_only = 1;
+                break;
+            case 'x':
+                program = optarg;
+                break;
+            case 'o':
+                output_path = optarg;
+                break;
+            case 'B':
+                baseline_path = optarg;
+                break;
+            case 'T':
+                tolerance = atof(optarg);
+                if (tolerance < 0) {
+                    fprintf(stderr, "Invalid tolerance: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            default:
+                fprintf(stderr, "Invalid option. Use --help for usage information.\n");
+                return 1;
+        }
+    }
+
+    char** structures = generate_structures(num_structures, &params, seed);
+    if (generate_only) {
+        for (int i = 0; i < num_structures; i++) puts(structures[i]);
+        free_strings(structures, num_structures);
+        return 0;
+    }
+
+    if (check_pairs > 0) {
+        fprintf(stderr, "Cross-checking %d pairs against the naive reference\n", check_pairs);
+        int mismatches = cross_check(check_pairs, &params, seed);
+        if (mismatches > 0) {
+            fprintf(stderr, "%d of %d pairs differ from the naive reference\n", mismatches, check_pairs);
+            free_strings(structures, num_structures);
+            return 1;
+        }
+    }
+
+    // Thread counts 1, 2, 4, ... up to and including max_threads
+    int thread_counts[32];
+    int num_counts = 0;
+    for (int t = 1; t < max_threads && num_counts < 31; t *= 2) thread_counts[num_counts++] = t;
+    thread_counts[num_counts++] = max_threads;
+
+    int max_results = 4 + 4 * num_counts;
+    Result* results = malloc(max_results * sizeof(Result));
+    if (!results) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return 1;
+    }
+    int num_results = 0;
+    int n = num_structures;
+    double all_pairs = (double)n * (n - 1) / 2;
+    size_t num_values = (size_t)n * (n - 1) / 2;
+    RnatedTree** trees = parse_all(structures, n, RNATED_ALGORITHM_AUTO);
+    int32_t* reference = malloc(num_values * sizeof(int32_t));
+    int32_t* batch = malloc(num_values * sizeof(int32_t));
+    RnatedWorkspace* ws;
+    if (!reference || !batch || rnated_workspace_create(NULL, &ws) != RNATED_OK) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return 1;
+    }
+
+    // Single pair latency: one thread, one workspace, all pairs in turn
+    fprintf(stderr, "Micro-benchmarks on %d structures of length %d\n", n, params.length);
+    double start = omp_get_wtime();
+    size_t k = 0;
+    for (int i = 0; i < n; i++) {
+        for (int j = i + 1; j < n; j++) rnated_distance(trees[i], trees[j], ws, &reference[k++]);
+    }
+    report(results, &num_results, "distance", 1, all_pairs, omp_get_wtime() - start);
+    start = omp_get_wtime();
+    for (int i = 0; i < n; i++) {
+        for (int j = i + 1; j < n; j++) {
+            int32_t d;
+            rnated_distance_bounded(trees[i], trees[j], MICRO_BOUND, ws, &d);
+        }
+    }
+    report(results, &num_results, "distance_bounded", 1, all_pairs, omp_get_wtime() - start);
+    rnated_workspace_free(ws);
+
+    // Batch scaling; every run must reproduce the single pair results
+    int batch_errors = 0;
+    for (int c = 0; c < num_counts; c++) {
+        start = omp_get_wtime();
+        rnated_condensed((const RnatedTree* const*)trees, n, NULL, thread_counts[c], batch);
+        report(results, &num_results, "condensed", thread_counts[c], all_pairs, omp_get_wtime() - start);
+        if (memcmp(batch, reference, num_values * sizeof(int32_t)) != 0) batch_errors++;
+    }
+    RnatedCache* cache;
+    if (rnated_cache_create((size_t)CACHE_MB << 20, &cache) != RNATED_OK) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return 1;
+    }
+    start = omp_get_wtime();
+    rnated_condensed((const RnatedTree* const*)trees, n, cache, max_threads, batch);
+    report(results, &num_results, "condensed_cached", max_threads, all_pairs, omp_get_wtime() - start);
+    if (memcmp(batch, reference, num_values * sizeof(int32_t)) != 0) batch_errors++;
+    rnated_cache_free(cache);
+    free_trees(trees, n);
+    free(reference);
+    free(batch);
+    if (batch_errors > 0) {
+        fprintf(stderr, "%d batch runs differ from single pair distances\n", batch_errors);
+        return 1;
+    }
+
+    // End-to-end runs of the command line tool on the same structures;
+    // duplicates are only computed once, so pairs count distinct structures
+    if (access(program, X_OK) == 0) {
+        char input_path[] = "/tmp/rnated_bench_XXXXXX";
+        int fd = mkstemp(input_path);
+        FILE* input = fd >= 0 ? fdopen(fd, "w") : NULL;
+        if (!input) {
+            fprintf(stderr, "Cannot create temporary input file\n");
+            return 1;
+        }
+        for (int i = 0; i < n; i++) fprintf(input, "%s\n", structures[i]);
+        fclose(input);
+        int unique = count_unique(structures, n);
+        double unique_pairs = (double)unique * (unique - 1) / 2;
+        struct { const char* name; const char* flags; double pairs; } modes[] = {
+            {"cli_full", "", unique_pairs},
+            {"cli_row_wise", "--row-wise", unique_pairs},
+            {"cli_first_only", "--first-only", unique - 1},
+        };
+        fprintf(stderr, "End-to-end runs of %s\n", program);
+        for (int m = 0; m < 3; m++) {
+            for (int c = 0; c < num_counts; c++) {
+                char command[1024];
+                snprintf(command, sizeof(command), "%s %s --threads %d < %s > /dev/null 2> /dev/null",
+                         program, modes[m].flags, thread_counts[c], input_path);
+                double seconds = run_command(command);
+                if (seconds < 0) {
+                    fprintf(stderr, "Command failed: %s\n", command);
+                    unlink(input_path);
+                    return 1;
+                }
+                report(results, &num_results, modes[m].name, thread_counts[c], modes[m].pairs, seconds);
+            }
+        }
+        unlink(input_path);
+        if (shard_check(program, &params, seed) != 0) {
+            fprintf(stderr, "Merged shards of %d structures differ from a single run\n", SHARD_CHECK_STRUCTURES);
+            return 1;
+        }
+    } else {
+        fprintf(stderr, "%s not found, skipping end-to-end runs\n", program);
+    }
+    free_strings(structures, num_structures);
+
+    Result baseline[MAX_BASELINE];
+    int num_baseline = baseline_path ? load_baseline(baseline_path, baseline) : 0;
+    FILE* output = NULL;
+    if (output_path) {
+        output = fopen(output_path, "w");
+        if (!output) {
+            fprintf(stderr, "Cannot open output file %s\n", output_path);
+            return 1;
+        }
+    }
+    // Scaling efficiency relates each thread count to the one-thread run
+    // of the same benchmark
+    int regressions = 0;
+    printf("benchmark\tthreads\tpairs\tseconds\tpairs_per_second\tefficiency%s\n", baseline_path ? "\tvs_baseline" : "");
+    if (output) fprintf(output, "benchmark\tthreads\tpairs\tseconds\tpairs_per_second\tefficiency\n");
+    for (int r = 0; r < num_results; r++) {
+        Result* res = &results[r];
+        double single = 0;
+        for (int s = 0; s < num_results; s++) {
+            if (results[s].threads == 1 && strcmp(results[s].name, res->name) == 0) single = results[s].pairs_per_second;
+        }
+        double efficiency = single > 0 ? res->pairs_per_second / (single * res->threads) : 0;
+        char line[256];
+        snprintf(line, sizeof(line), "%s\t%d\t%.0f\t%.3f\t%.1f\t%.2f",
+                 res->name, res->threads, res->pairs, res->seconds, res->pairs_per_second, efficiency);
+        printf("%s", line);
+        if (output) fprintf(output, "%s\n", line);
+        if (baseline_path) {
+            const Result* old = NULL;
+            for (int b = 0; b < num_baseline; b++) {
+                if (baseline[b].threads == res->threads && strcmp(baseline[b].name, res->name) == 0) old = &baseline[b];
+            }
+            if (old && old->pairs_per_second > 0) {
+                double change = 100.0 * (res->pairs_per_second / old->pairs_per_second - 1);
+                printf("\t%+.1f%%", change);
+                if (change < -tolerance) regressions++;
+            } else {
+                printf("\t-");
+            }
+        }
+        printf("\n");
+    }
+    if (output) fclose(output);
+    free(results);
+    if (regressions > 0) {
+        fprintf(stderr, "%d benchmarks are more than %.0f%% slower than the baseline\n", regressions, tolerance);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,106 @@
+#ifndef RNATED_INTERNAL_H
+#define RNATED_INTERNAL_H
+
+// Engine data structures and functions shared by the library and the
+// command line tool; not part of the public API
+
+#include <stdint.h>
+#include <limits.h>
+#include <omp.h>
+#include "rnated.h"
+
+#define CACHE_SHARDS 64
+#define NO_BOUND (INT_MAX / 4) // Bound that never saturates, for exact distances
+
+// Flat, pointer-free tree: node arrays are indexed by postorder position
+typedef struct TreeInfo {
+    uint8_t* labels;   // 'P' for pair, 'U' for unpaired, 'R' for root
+    int32_t* leftmost; // Postorder index of each node's leftmost leaf
+    int32_t* keyroots; // Keyroots in ascending postorder
+    int postorder_size;
+    int num_keyroots;
+    int num_pairs;     // Label counts, used for distance lower bounds
+    int num_unpaired;
+    int64_t keyroot_cost;     // Sum of keyroot subtree sizes; a pair costs the product
+    struct TreeInfo* mirror;  // Mirror image for right-path decomposition, or NULL
+    int mirrored;             // Whether this tree is itself the mirror image of the structure
+    uint64_t* keyroot_hash;   // Canonical hash of each keyroot's subtree
+} TreeInfo;
+
+// Work done by one thread. Only the owning thread writes the counters, with
+// relaxed atomic stores instead of read-modify-write operations, so other
+// threads can read them during a run without locks or shared cache lines
+typedef struct WorkCounters {
+    int64_t pairs;          // Distance computations
+    int64_t keyroot_pairs;  // Keyroot pairs solved by the forest-distance DP
+    int64_t dp_cells;       // Forest-distance cells evaluated
+    int64_t cache_hits;     // Keyroot pairs copied from the subtree cache
+    int64_t busy_ns;        // Time spent in distance computations, if timed
+    int timed;
+} WorkCounters;
+
+// Per-thread scratch space reused across all pairs a thread processes
+typedef struct Workspace {
+    int* treedist; // Subtree distances, row stride = postorder size of the second tree
+    int* fd;       // Forest distances for the current keyroot pair
+    int32_t* path1; // Leftmost-path nodes of the current keyroots (subtree cache)
+    int32_t* path2;
+    int max_nodes; // Largest postorder size the buffers can hold
+    struct SubtreeCache* cache; // Shared cache for exact distances, or NULL
+    WorkCounters* counters;     // own_counters unless redirected by the caller
+    WorkCounters own_counters;
+} Workspace;
+
+typedef struct CacheEntry {
+    uint64_t hash1;  // Keyroot subtree hashes of both trees
+    uint64_t hash2;
+    int len1;        // Leftmost-path lengths, which also guard against collisions
+    int len2;
+    size_t bytes;
+    int values[];    // Path-pair subtree distances, len1 x len2
+} CacheEntry;
+
+typedef struct CacheShard {
+    omp_lock_t lock;
+    CacheEntry** slots;
+    size_t bytes;
+    long long hits;
+    long long misses;
+} CacheShard;
+
+typedef struct SubtreeCache {
+    CacheShard shards[CACHE_SHARDS];
+    int slots_per_shard;
+    size_t shard_budget;
+} SubtreeCache;
+
+static inline int min(int a, int b) {
+    return a < b ? a : b;
+}
+
+static inline void counter_add(int64_t* counter, int64_t value) {
+    __atomic_store_n(counter, *counter + value, __ATOMIC_RELAXED);
+}
+
+static inline int64_t counter_read(const int64_t* counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+// Allocation failures return NULL (or -1 for distances) instead of exiting
+SubtreeCache* create_subtree_cache(size_t budget_bytes);
+void free_subtree_cache(SubtreeCache* cache);
+void free_tree_info(TreeInfo* ti);
+Workspace* create_workspace(int max_nodes, SubtreeCache* cache);
+int reserve_workspace(Workspace* ws, int max_nodes);
+void free_workspace(Workspace* ws);
+Workspace** create_workspace_pool(int max_nodes, int count, SubtreeCache* cache);
+void free_workspace_pool(Workspace** pool, int count);
+// Both trees must fit into the workspace
+int tree_edit_dist(const TreeInfo* t1, const TreeInfo* t2, Workspace* ws);
+int tree_edit_dist_bounded(const TreeInfo* t1, const TreeInfo* t2, int bound, Workspace* ws);
+int tree_edit_dist_parallel(const TreeInfo* t1, const TreeInfo* t2, Workspace** pool, int pool_size);
+int use_intra_pair(long long num_pairs, int max_nodes, int num_threads);
+int ted_lower_bound(const TreeInfo* t1, const TreeInfo* t2);
+int label_count_bound(int pairs1, int unpaired1, int pairs2, int unpaired2);
+
+#endif